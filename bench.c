@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "import.c"
+
+/*
+ * Drives the pager and B+tree directly, without the REPL, and reports
+ * throughput and latency percentiles per workload as JSON on stdout.
+ *
+ *   ninjadb_bench [--rows N] [--cache FRAMES] [--range N] [--group-commit N]
+ *                 [--threads N] [--mmap] [--readahead PAGES] [--sync-io] [--seed N]
+ *                 [--file PATH]
+ */
+
+typedef struct {
+    const char* name;
+    uint64_t ops;
+    uint64_t rows;
+    double seconds;
+    double p50;
+    double p99;
+    double p999;
+} BenchResult;
+
+typedef struct {
+    uint64_t* samples;
+    uint64_t numSamples;
+    uint64_t started;
+    uint64_t opStarted;
+} BenchTimer;
+
+uint64_t benchNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+void benchStart(BenchTimer* timer, uint64_t maxOps) {
+    timer -> samples = (uint64_t*) malloc(maxOps * sizeof(uint64_t));
+    timer -> numSamples = 0;
+    timer -> started = benchNow();
+}
+
+void benchOpStart(BenchTimer* timer) {
+    timer -> opStarted = benchNow();
+}
+
+void benchOpEnd(BenchTimer* timer) {
+    timer -> samples[timer -> numSamples++] = benchNow() - timer -> opStarted;
+}
+
+int compareSamples(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*) a;
+    uint64_t right = *(const uint64_t*) b;
+    return (left > right) - (left < right);
+}
+
+double benchPercentile(uint64_t* sorted, uint64_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t index = (uint64_t) (fraction * (double) (count - 1) + 0.5);
+    return (double) sorted[index] / 1000.0;
+}
+
+BenchResult benchFinish(BenchTimer* timer, const char* name, uint64_t rows) {
+    uint64_t elapsed = benchNow() - timer -> started;
+    qsort(timer -> samples, timer -> numSamples, sizeof(uint64_t), compareSamples);
+
+    BenchResult result;
+    result.name = name;
+    result.ops = timer -> numSamples;
+    result.rows = rows;
+    result.seconds = (double) elapsed / 1e9;
+    result.p50 = benchPercentile(timer -> samples, timer -> numSamples, 0.50);
+    result.p99 = benchPercentile(timer -> samples, timer -> numSamples, 0.99);
+    result.p999 = benchPercentile(timer -> samples, timer -> numSamples, 0.999);
+    free(timer -> samples);
+    return result;
+}
+
+void benchRow(uint32_t id, Row* row) {
+    row -> id = id;
+    snprintf(row -> username, sizeof(row -> username), "user%u", id);
+    snprintf(row -> email, sizeof(row -> email), "user%u@example.com", id);
+}
+
+/*
+ * A fresh database file with no log left over from an earlier run.
+ */
+Table* benchOpen(const char* filename, PagerOptions options) {
+    char walFilename[PATH_MAX];
+    snprintf(walFilename, sizeof(walFilename), "%s-wal", filename);
+    unlink(filename);
+    unlink(walFilename);
+    return openDB(filename, options);
+}
+
+void benchRemove(const char* filename) {
+    char walFilename[PATH_MAX];
+    snprintf(walFilename, sizeof(walFilename), "%s-wal", filename);
+    unlink(filename);
+    unlink(walFilename);
+}
+
+/*
+ * Every insert commits on its own, as a statement outside a transaction does.
+ */
+BenchResult benchInsert(Table* table, const char* name, uint32_t* ids, uint32_t numRows) {
+    BenchTimer timer;
+    Row row;
+    benchStart(&timer, numRows);
+    for (uint32_t i = 0; i < numRows; i++) {
+        benchRow(ids[i], &row);
+        benchOpStart(&timer);
+        Cursor* cursor = tableFind(table, row.id);
+        leafNodeInsert(cursor, row.id, &row);
+        free(cursor);
+        pagerCommit(table -> pager);
+        benchOpEnd(&timer);
+    }
+    pagerSync(table -> pager);
+    return benchFinish(&timer, name, numRows);
+}
+
+BenchResult benchLookup(Table* table, uint32_t* ids, uint32_t numRows) {
+    BenchTimer timer;
+    Row row;
+    benchStart(&timer, numRows);
+    for (uint32_t i = 0; i < numRows; i++) {
+        benchOpStart(&timer);
+        if (!tableFindRow(table, ids[i], &row)) {
+            printf("Lookup of id %u failed.\n", ids[i]);
+            exit(EXIT_FAILURE);
+        }
+        benchOpEnd(&timer);
+    }
+    return benchFinish(&timer, "point_lookup", numRows);
+}
+
+typedef struct {
+    Table* table;
+    uint32_t* ids;
+    uint32_t numIds;
+    uint64_t* samples;
+} LookupWorker;
+
+void* benchLookupWorker(void* argument) {
+    LookupWorker* worker = (LookupWorker*) argument;
+    Row row;
+    for (uint32_t i = 0; i < worker -> numIds; i++) {
+        uint64_t started = benchNow();
+        if (!tableFindRow(worker -> table, worker -> ids[i], &row)) {
+            printf("Lookup of id %u failed.\n", worker -> ids[i]);
+            exit(EXIT_FAILURE);
+        }
+        worker -> samples[i] = benchNow() - started;
+    }
+    return NULL;
+}
+
+/*
+ * The same lookups as point_lookup, split across numThreads reader threads.
+ */
+BenchResult benchParallelLookup(Table* table, uint32_t* ids, uint32_t numRows, uint32_t numThreads) {
+    BenchTimer timer;
+    pthread_t threads[numThreads];
+    LookupWorker workers[numThreads];
+    benchStart(&timer, numRows);
+    uint32_t perThread = numRows / numThreads;
+    for (uint32_t i = 0; i < numThreads; i++) {
+        workers[i].table = table;
+        workers[i].ids = ids + (size_t) i * perThread;
+        workers[i].numIds = (i == numThreads - 1) ? numRows - i * perThread : perThread;
+        workers[i].samples = timer.samples + (size_t) i * perThread;
+        if (pthread_create(&threads[i], NULL, benchLookupWorker, &workers[i]) != 0) {
+            printf("Could not start thread %u.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint32_t i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    timer.numSamples = numRows;
+    return benchFinish(&timer, "point_lookup_parallel", numRows);
+}
+
+uint64_t benchScanRange(Table* table, uint32_t low, uint32_t high) {
+    RowBatch batch = { 0 };
+    uint64_t numRows = 0;
+    uint64_t checksum = 0;
+    Cursor* cursor = tableSeek(table, low);
+    while (cursorNextBatch(cursor, &batch)) {
+        for (uint32_t i = 0; i < batch.numRows && batch.ids[i] <= high; i++) {
+            checksum += batch.ids[i] + batch.usernameLengths[i] + batch.emailLengths[i];
+            numRows++;
+        }
+        if (batch.ids[batch.numRows - 1] >= high) {
+            break;
+        }
+    }
+    rowBatchRelease(table -> pager, &batch);
+    free(cursor);
+    // Keeps the compiler from dropping the loop
+    return numRows + (checksum == 1);
+}
+
+BenchResult benchFullScan(Table* table, uint32_t numScans) {
+    BenchTimer timer;
+    uint64_t rows = 0;
+    benchStart(&timer, numScans);
+    for (uint32_t i = 0; i < numScans; i++) {
+        benchOpStart(&timer);
+        rows += benchScanRange(table, 0, UINT32_MAX);
+        benchOpEnd(&timer);
+    }
+    return benchFinish(&timer, "full_scan", rows);
+}
+
+BenchResult benchRangeScan(Table* table, uint32_t numRows, uint32_t rangeSize, uint32_t numScans) {
+    BenchTimer timer;
+    uint64_t rows = 0;
+    benchStart(&timer, numScans);
+    for (uint32_t i = 0; i < numScans; i++) {
+        uint32_t low = 1 + (uint32_t) (rand() % numRows);
+        benchOpStart(&timer);
+        rows += benchScanRange(table, low, low + rangeSize - 1);
+        benchOpEnd(&timer);
+    }
+    return benchFinish(&timer, "range_scan", rows);
+}
+
+typedef struct {
+    Table* table;
+    uint32_t numRows;
+    uint32_t rangeSize;
+    uint32_t numScans;
+    unsigned int seed;
+    uint64_t rows;
+    uint64_t* samples;
+} ScanWorker;
+
+typedef struct {
+    Table* table;
+    uint32_t numRows;
+    int stopping;
+    uint64_t ops;
+} WriterWorker;
+
+/*
+ * Range scans that check what they see against what the writer can change:
+ * ids come in ascending order from the seek key on, and no odd id is ever
+ * missing, since the writer only deletes and reinserts even ones.
+ */
+void* benchScanWorker(void* argument) {
+    ScanWorker* worker = (ScanWorker*) argument;
+    for (uint32_t i = 0; i < worker -> numScans; i++) {
+        uint32_t low = 1 + (uint32_t) (rand_r(&(worker -> seed)) % worker -> numRows);
+        uint32_t high = low + worker -> rangeSize - 1;
+        uint32_t last = high < worker -> numRows ? high : worker -> numRows;
+        uint32_t expected = (last + 1) / 2 - low / 2;
+        uint32_t odd = 0;
+        uint32_t previous = 0;
+        bool done = false;
+        RowBatch batch = { 0 };
+        uint64_t started = benchNow();
+        Cursor* cursor = tableSeek(worker -> table, low);
+        while (!done && cursorNextBatch(cursor, &batch)) {
+            for (uint32_t j = 0; j < batch.numRows && !done; j++) {
+                uint32_t id = batch.ids[j];
+                if (id < low || (odd + previous > 0 && id <= previous)) {
+                    printf("Scan from %u returned id %u after %u.\n", low, id, previous);
+                    exit(EXIT_FAILURE);
+                }
+                done = id >= high;
+                if (id <= high) {
+                    odd += id % 2;
+                    worker -> rows++;
+                }
+                previous = id;
+            }
+        }
+        rowBatchRelease(worker -> table -> pager, &batch);
+        free(cursor);
+        worker -> samples[i] = benchNow() - started;
+        if (odd != expected) {
+            printf("Scan of %u to %u found %u odd ids, not %u.\n", low, high, odd, expected);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The single writer: deletes and reinserts even ids and rewrites rows with
+ * emails of varying length, so cells move within leaves and leaves split and
+ * merge under the scans. Every change commits on its own.
+ */
+void* benchWriterWorker(void* argument) {
+    WriterWorker* worker = (WriterWorker*) argument;
+    Table* table = worker -> table;
+    unsigned int seed = worker -> numRows;
+    Row row;
+    while (!__atomic_load_n(&(worker -> stopping), __ATOMIC_RELAXED)) {
+        uint32_t id = 1 + (uint32_t) (rand_r(&seed) % worker -> numRows);
+        Cursor* cursor = tableFind(table, id);
+        bool present = cursorMatchesKey(cursor, id);
+        benchRow(id, &row);
+        if (worker -> ops % 3 == 2 && present) {
+            uint32_t length = (uint32_t) strlen(row.email);
+            uint32_t padding = (uint32_t) (rand_r(&seed) % (COLUMN_EMAIL_SIZE - length));
+            memset(row.email + length, 'x', padding);
+            row.email[length + padding] = '\0';
+            leafNodeUpdate(cursor, &row);
+        } else if (id % 2 == 0 && present) {
+            leafNodeDelete(cursor, 1);
+        } else if (!present) {
+            leafNodeInsert(cursor, id, &row);
+        }
+        free(cursor);
+        pagerCommit(table -> pager);
+        worker -> ops++;
+    }
+    return NULL;
+}
+
+/*
+ * range_scan split across numThreads reader threads while one writer changes
+ * the table underneath them. The mmap pager has no latches, so there the
+ * scans run without the writer.
+ */
+BenchResult benchRangeScanWithWriter(Table* table, uint32_t numRows, uint32_t rangeSize, uint32_t numScans,
+                                     uint32_t numThreads) {
+    BenchTimer timer;
+    pthread_t threads[numThreads];
+    ScanWorker workers[numThreads];
+    pthread_t writerThread;
+    WriterWorker writer = { table, numRows, 0, 0 };
+    bool writing = table -> pager -> mode != PAGER_MMAP;
+    if (writing && pthread_create(&writerThread, NULL, benchWriterWorker, &writer) != 0) {
+        printf("Could not start the writer thread.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    benchStart(&timer, numScans);
+    uint32_t perThread = numScans / numThreads;
+    for (uint32_t i = 0; i < numThreads; i++) {
+        workers[i].table = table;
+        workers[i].numRows = numRows;
+        workers[i].rangeSize = rangeSize;
+        workers[i].numScans = (i == numThreads - 1) ? numScans - i * perThread : perThread;
+        workers[i].seed = (unsigned int) rand();
+        workers[i].rows = 0;
+        workers[i].samples = timer.samples + (size_t) i * perThread;
+        if (pthread_create(&threads[i], NULL, benchScanWorker, &workers[i]) != 0) {
+            printf("Could not start thread %u.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t rows = 0;
+    for (uint32_t i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+        rows += workers[i].rows;
+    }
+    timer.numSamples = numScans;
+    BenchResult result = benchFinish(&timer, "range_scan_with_writer", rows);
+
+    if (writing) {
+        __atomic_store_n(&(writer.stopping), 1, __ATOMIC_RELAXED);
+        pthread_join(writerThread, NULL);
+    }
+    return result;
+}
+
+void shuffleIds(uint32_t* ids, uint32_t count) {
+    for (uint32_t i = count; i > 1; i--) {
+        uint32_t j = (uint32_t) (((uint64_t) rand() * RAND_MAX + rand()) % i);
+        uint32_t id = ids[i - 1];
+        ids[i - 1] = ids[j];
+        ids[j] = id;
+    }
+}
+
+void printResult(BenchResult* result, bool last) {
+    double opsPerSecond = result -> seconds > 0 ? (double) result -> ops / result -> seconds : 0;
+    double rowsPerSecond = result -> seconds > 0 ? (double) result -> rows / result -> seconds : 0;
+    printf("    {\"name\": \"%s\", \"ops\": %llu, \"rows\": %llu, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.1f, \"rows_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}%s\n",
+           result -> name, (unsigned long long) result -> ops, (unsigned long long) result -> rows, result -> seconds,
+           opsPerSecond, rowsPerSecond, result -> p50, result -> p99, result -> p999, last ? "" : ",");
+    fprintf(stderr, "%-22s %12.0f ops/s  p50 %9.3fus  p99 %9.3fus  p999 %9.3fus\n",
+            result -> name, opsPerSecond, result -> p50, result -> p99, result -> p999);
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t numRows = 100000;
+    uint32_t rangeSize = 100;
+    uint32_t numThreads = 4;
+    unsigned int seed = 42;
+    const char* filename = "ninjadb_bench.db";
+    PagerOptions options = { PAGER_POOL, DEFAULT_POOL_FRAMES, WAL_GROUP_COMMIT_SIZE, PAGER_READAHEAD_PAGES, false };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            numRows = (uint32_t) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.numFrames = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--group-commit") == 0 && i + 1 < argc) {
+            options.groupCommitSize = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--range") == 0 && i + 1 < argc) {
+            rangeSize = (uint32_t) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            numThreads = (uint32_t) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            filename = argv[++i];
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.mode = PAGER_MMAP;
+        } else if (strcmp(argv[i], "--readahead") == 0 && i + 1 < argc) {
+            options.readaheadPages = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sync-io") == 0) {
+            options.syncIo = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--rows N] [--cache FRAMES] [--range N] [--group-commit N] "
+                            "[--threads N] [--mmap] [--readahead PAGES] [--sync-io] [--seed N] [--file PATH]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (numRows == 0 || rangeSize == 0 || numThreads == 0) {
+        fprintf(stderr, "--rows, --range and --threads must be at least 1.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.mode == PAGER_MMAP) {
+        // The mmap pager has no frames to latch, so it only takes one thread
+        numThreads = 1;
+    }
+    srand(seed);
+
+    uint32_t* ids = (uint32_t*) malloc(numRows * sizeof(uint32_t));
+    for (uint32_t i = 0; i < numRows; i++) {
+        ids[i] = i + 1;
+    }
+    BenchResult results[7];
+
+    Table* table = benchOpen(filename, options);
+    results[0] = benchInsert(table, "insert_sequential", ids, numRows);
+    closeDB(table);
+
+    shuffleIds(ids, numRows);
+    table = benchOpen(filename, options);
+    // The pager clamps the pool to MIN_POOL_FRAMES, so report what it actually used
+    uint32_t cacheFrames = table -> pager -> numFrames;
+    results[1] = benchInsert(table, "insert_random", ids, numRows);
+
+    shuffleIds(ids, numRows);
+    results[2] = benchLookup(table, ids, numRows);
+    results[5] = benchParallelLookup(table, ids, numRows, numThreads);
+    results[3] = benchFullScan(table, 10);
+    results[4] = benchRangeScan(table, numRows, rangeSize, numRows / 10 > 0 ? numRows / 10 : 1);
+    results[6] = benchRangeScanWithWriter(table, numRows, rangeSize, numRows / 10 > numThreads ? numRows / 10 : numThreads,
+                                          numThreads);
+    closeDB(table);
+    benchRemove(filename);
+    free(ids);
+
+    printf("{\n  \"rows\": %u,\n  \"cache_frames\": %u,\n  \"pager\": \"%s\",\n  \"group_commit\": %u,\n"
+           "  \"range_size\": %u,\n  \"threads\": %u,\n  \"seed\": %u,\n  \"benchmarks\": [\n",
+           numRows, cacheFrames, options.mode == PAGER_MMAP ? "mmap" : "pool", options.groupCommitSize,
+           rangeSize, numThreads, seed);
+    for (uint32_t i = 0; i < 7; i++) {
+        printResult(&results[i], i == 6);
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
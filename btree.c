@@ -0,0 +1,1427 @@
+#include "freelist.c"
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Common node accessors
+ */
+NodeType getNodeType(void* node) {
+    uint8_t value = *((uint8_t*) (node + NODE_TYPE_OFFSET));
+    return (NodeType) value;
+}
+
+void setNodeType(void* node, NodeType type) {
+    *((uint8_t*) (node + NODE_TYPE_OFFSET)) = (uint8_t) type;
+}
+
+bool isNodeRoot(void* node) {
+    return (bool) *((uint8_t*) (node + IS_ROOT_OFFSET));
+}
+
+void setNodeRoot(void* node, bool isRoot) {
+    *((uint8_t*) (node + IS_ROOT_OFFSET)) = (uint8_t) isRoot;
+}
+
+/*
+ * Leaf node accessors
+ */
+uint32_t* leafNodeNumCells(void* node) {
+    return (uint32_t*) (node + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+uint16_t* leafNodeContentStart(void* node) {
+    return (uint16_t*) (node + LEAF_NODE_CONTENT_START_OFFSET);
+}
+
+uint32_t* leafNodeNextLeaf(void* node) {
+    return (uint32_t*) (node + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+uint32_t* leafNodeKeys(void* node) {
+    return (uint32_t*) (node + LEAF_NODE_HEADER_SIZE);
+}
+
+uint32_t* leafNodeKey(void* node, uint32_t cell_num) {
+    return leafNodeKeys(node) + cell_num;
+}
+
+/*
+ * The offsets start where the keys end, so they move whenever a cell is added.
+ */
+uint16_t* leafNodeSlot(void* node, uint32_t cell_num) {
+    return (uint16_t*) (node + LEAF_NODE_HEADER_SIZE + *leafNodeNumCells(node) * LEAF_NODE_KEY_SIZE
+                        + cell_num * LEAF_NODE_OFFSET_SIZE);
+}
+
+void* leafNodeCell(void* node, uint32_t cell_num) {
+    return node + *leafNodeSlot(node, cell_num);
+}
+
+uint32_t leafNodeCellSize(void* node, uint32_t cell_num) {
+    uint8_t* cell = (uint8_t*) leafNodeCell(node, cell_num);
+    uint32_t usernameLength = cell[0];
+    uint32_t emailLength = cell[LEAF_NODE_STRING_LENGTH_SIZE + usernameLength];
+    return 2 * LEAF_NODE_STRING_LENGTH_SIZE + usernameLength + emailLength;
+}
+
+/*
+ * Bytes left between the end of the offset array and the lowest cell.
+ */
+uint32_t leafNodeFreeSpace(void* node) {
+    return *leafNodeContentStart(node) - (LEAF_NODE_HEADER_SIZE + *leafNodeNumCells(node) * LEAF_NODE_SLOT_SIZE);
+}
+
+/*
+ * Carve a cellSize byte cell for key out of the free space and give it
+ * position cellNum. The offset array shifts up by one key to make room for
+ * the new key, and later keys and offsets shift by one entry; cells stay put.
+ * The caller checks leafNodeFreeSpace first and fills the cell in.
+ */
+void* leafNodeAllocateCell(void* node, uint32_t cellNum, uint32_t key, uint32_t cellSize) {
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint32_t* keys = leafNodeKeys(node);
+    uint16_t* oldOffsets = (uint16_t*) (keys + numCells);
+    uint16_t* newOffsets = (uint16_t*) (keys + numCells + 1);
+    uint16_t offset = *leafNodeContentStart(node) - cellSize;
+
+    // Offsets first: the keys grow into the space they leave
+    memmove(newOffsets + cellNum + 1, oldOffsets + cellNum, (numCells - cellNum) * LEAF_NODE_OFFSET_SIZE);
+    memmove(newOffsets, oldOffsets, cellNum * LEAF_NODE_OFFSET_SIZE);
+    memmove(keys + cellNum + 1, keys + cellNum, (numCells - cellNum) * LEAF_NODE_KEY_SIZE);
+    keys[cellNum] = key;
+    newOffsets[cellNum] = offset;
+    *leafNodeContentStart(node) = offset;
+    *leafNodeNumCells(node) = numCells + 1;
+    return node + offset;
+}
+
+/*
+ * Take cell cellNum out of the leaf. The cells packed below it move up over
+ * its bytes so the free space stays in one piece, and the offset array moves
+ * down by one key.
+ */
+void leafNodeRemoveCell(void* node, uint32_t cellNum) {
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint32_t* keys = leafNodeKeys(node);
+    uint16_t* oldOffsets = (uint16_t*) (keys + numCells);
+    uint16_t* newOffsets = (uint16_t*) (keys + numCells - 1);
+    uint16_t offset = oldOffsets[cellNum];
+    uint16_t cellSize = (uint16_t) leafNodeCellSize(node, cellNum);
+    uint16_t contentStart = *leafNodeContentStart(node);
+
+    memmove(node + contentStart + cellSize, node + contentStart, offset - contentStart);
+    for (uint32_t i = 0; i < numCells; i++) {
+        if (oldOffsets[i] < offset) {
+            oldOffsets[i] += cellSize;
+        }
+    }
+    // Keys first: the offsets move down into the space they leave
+    memmove(keys + cellNum, keys + cellNum + 1, (numCells - cellNum - 1) * LEAF_NODE_KEY_SIZE);
+    memmove(newOffsets, oldOffsets, cellNum * LEAF_NODE_OFFSET_SIZE);
+    memmove(newOffsets + cellNum, oldOffsets + cellNum + 1, (numCells - cellNum - 1) * LEAF_NODE_OFFSET_SIZE);
+    *leafNodeContentStart(node) = contentStart + cellSize;
+    *leafNodeNumCells(node) = numCells - 1;
+}
+
+/*
+ * Give cell cellNum a size of cellSize bytes, keeping its key and slot. The
+ * cells packed below it move by the difference; the caller checks that a
+ * larger cell fits in the free space and fills the cell in.
+ */
+void* leafNodeResizeCell(void* node, uint32_t cellNum, uint32_t cellSize) {
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint16_t* offsets = leafNodeSlot(node, 0);
+    uint16_t offset = offsets[cellNum];
+    int32_t growth = (int32_t) cellSize - (int32_t) leafNodeCellSize(node, cellNum);
+    uint16_t contentStart = *leafNodeContentStart(node);
+
+    memmove(node + contentStart - growth, node + contentStart, offset - contentStart);
+    for (uint32_t i = 0; i < numCells; i++) {
+        if (offsets[i] <= offset) {
+            offsets[i] -= growth;
+        }
+    }
+    *leafNodeContentStart(node) = contentStart - growth;
+    return node + offset - growth;
+}
+
+/*
+ * Bytes taken by the leaf's cells and their slots.
+ */
+uint32_t leafNodeUsedSpace(void* node) {
+    return LEAF_NODE_SPACE_FOR_CELLS - leafNodeFreeSpace(node);
+}
+
+/*
+ * Internal node accessors
+ */
+uint32_t* internalNodeNumKeys(void* node) {
+    return (uint32_t*) (node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint32_t* internalNodeRightChild(void* node) {
+    return (uint32_t*) (node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint32_t* internalNodeCell(void* node, uint32_t cellNum) {
+    return (uint32_t*) (node + INTERNAL_NODE_HEADER_SIZE + cellNum * INTERNAL_NODE_CELL_SIZE);
+}
+
+uint32_t* internalNodeChild(void* node, uint32_t childNum) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    if (childNum > numKeys) {
+        printf("Tried to access child_num %d > num_keys %d\n", childNum, numKeys);
+        exit(EXIT_FAILURE);
+    } else if (childNum == numKeys) {
+        return internalNodeRightChild(node);
+    } else {
+        return internalNodeCell(node, childNum);
+    }
+}
+
+uint32_t* internalNodeKey(void* node, uint32_t keyNum) {
+    return (void*) internalNodeCell(node, keyNum) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+/*
+ * Number of rows below child childNum. An insert bumps the counts on its whole
+ * path but only latches the levels a split can reach, so the counts are
+ * always loaded and added to atomically.
+ */
+uint32_t* internalNodeRowCount(void* node, uint32_t childNum) {
+    if (childNum == *internalNodeNumKeys(node)) {
+        return (uint32_t*) (node + INTERNAL_NODE_RIGHT_COUNT_OFFSET);
+    }
+    return (void*) internalNodeCell(node, childNum) + INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+}
+
+void initializeLeafNode(void* node) {
+    setNodeType(node, NODE_LEAF);
+    setNodeRoot(node, false);
+    *leafNodeNumCells(node) = 0;
+    *leafNodeContentStart(node) = PAGE_SIZE;
+    *leafNodeNextLeaf(node) = 0;  // 0 means no sibling, since page 0 is always the root
+}
+
+void initializeInternalNode(void* node) {
+    setNodeType(node, NODE_INTERNAL);
+    setNodeRoot(node, false);
+    *internalNodeNumKeys(node) = 0;
+    *internalNodeRowCount(node, 0) = 0;
+}
+
+/*
+ * Size of the leaf cell holding row: each string behind a one byte length.
+ */
+uint32_t rowCellSize(Row* row) {
+    return 2 * LEAF_NODE_STRING_LENGTH_SIZE + strlen(row -> username) + strlen(row -> email);
+}
+
+/*
+ * The id is the cell's key, so only the strings are stored in the cell.
+ */
+void serializeRow(Row* source, void* destination) {
+    uint8_t usernameLength = (uint8_t) strlen(source -> username);
+    uint8_t emailLength = (uint8_t) strlen(source -> email);
+    uint8_t* value = (uint8_t*) destination;
+    *value++ = usernameLength;
+    memcpy(value, source -> username, usernameLength);
+    value += usernameLength;
+    *value++ = emailLength;
+    memcpy(value, source -> email, emailLength);
+}
+
+void deserializeRow(void* source, Row* destination) {
+    uint8_t* value = (uint8_t*) source;
+    uint8_t usernameLength = *value++;
+    memcpy(destination -> username, value, usernameLength);
+    destination -> username[usernameLength] = '\0';
+    value += usernameLength;
+    uint8_t emailLength = *value++;
+    memcpy(destination -> email, value, emailLength);
+    destination -> email[emailLength] = '\0';
+}
+
+uint32_t getPageMaxKey(Pager* pager, uint32_t pageNum);
+
+uint32_t getNodeMaxKey(Pager* pager, void* node) {
+    if (getNodeType(node) == NODE_LEAF) {
+        return *leafNodeKey(node, *leafNodeNumCells(node) - 1);
+    }
+    return getPageMaxKey(pager, *internalNodeRightChild(node));
+}
+
+uint32_t getPageMaxKey(Pager* pager, uint32_t pageNum) {
+    void* node = getPage(pager, pageNum);
+    uint32_t maxKey = getNodeMaxKey(pager, node);
+    unpinPage(pager, pageNum);
+    return maxKey;
+}
+
+uint32_t nodeRowCount(void* node) {
+    if (getNodeType(node) == NODE_LEAF) {
+        return *leafNodeNumCells(node);
+    }
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    uint32_t rowCount = 0;
+    for (uint32_t i = 0; i <= numKeys; i++) {
+        rowCount += __atomic_load_n(internalNodeRowCount(node, i), __ATOMIC_RELAXED);
+    }
+    return rowCount;
+}
+
+uint32_t getPageRowCount(Pager* pager, uint32_t pageNum) {
+    void* node = getPage(pager, pageNum);
+    uint32_t rowCount = nodeRowCount(node);
+    unpinPage(pager, pageNum);
+    return rowCount;
+}
+
+/*
+ * New pages come off the free list first and only go onto the end of the
+ * database file once it is empty.
+ */
+uint32_t getUnusedPageNum(Pager* pager) {
+    uint32_t pageNum = freeListPop(pager);
+    return pageNum != 0 ? pageNum : pager -> numPages;
+}
+
+/*
+ * Return the index of the child which should contain the given key.
+ */
+uint32_t internalNodeFindChild(void* node, uint32_t key) {
+    uint32_t minIndex = 0;
+    uint32_t maxIndex = *internalNodeNumKeys(node); // there is one more child than key
+
+    while (minIndex != maxIndex) {
+        uint32_t index = (minIndex + maxIndex) / 2;
+        uint32_t keyToRight = *internalNodeKey(node, index);
+        if (keyToRight >= key) {
+            maxIndex = index;
+        } else {
+            minIndex = index + 1;
+        }
+    }
+    return minIndex;
+}
+
+/*
+ * Return the position of a child page inside its parent. Splits use this rather
+ * than the separator keys so the new sibling always lands right after the node
+ * it was split from.
+ */
+uint32_t internalNodeChildIndex(void* node, uint32_t childPageNum) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    for (uint32_t i = 0; i <= numKeys; i++) {
+        if (*internalNodeChild(node, i) == childPageNum) {
+            return i;
+        }
+    }
+    printf("Page %d is not a child of this node.\n", childPageNum);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Number of the count keys starting at keys that are below key. The keys are
+ * compared a whole vector at a time; SSE2 has no unsigned compare, so both
+ * sides are biased into signed range first.
+ */
+uint32_t countKeysBelow(const uint32_t* keys, uint32_t count, uint32_t key) {
+    uint32_t below = 0;
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    __m256i bias8 = _mm256_set1_epi32((int32_t) 0x80000000u);
+    __m256i needle8 = _mm256_xor_si256(_mm256_set1_epi32((int32_t) key), bias8);
+    for (; i + 8 <= count; i += 8) {
+        __m256i chunk = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (keys + i)), bias8);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle8, chunk)));
+        below += __builtin_popcount(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i bias = _mm_set1_epi32((int32_t) 0x80000000u);
+    __m128i needle = _mm_xor_si128(_mm_set1_epi32((int32_t) key), bias);
+    for (; i + 4 <= count; i += 4) {
+        __m128i chunk = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (keys + i)), bias);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(needle, chunk)));
+        below += __builtin_popcount(mask);
+    }
+#endif
+    for (; i < count; i++) {
+        below += keys[i] < key;
+    }
+    return below;
+}
+
+/*
+ * Search the leaf's key array for key. The result is the first cell
+ * whose key is at least key, which is where the key would be inserted if it
+ * isn't present. Index trees hold duplicate keys, so this has to be the
+ * first of a run. Binary search narrows the range down to a few vectors'
+ * worth of keys, and since the keys are sorted, counting the ones below key
+ * in that window gives the position.
+ */
+uint32_t leafNodeSearch(void* node, uint32_t key) {
+    uint32_t* keys = leafNodeKeys(node);
+
+    uint32_t minIndex = 0;
+    uint32_t onePastMaxIndex = *leafNodeNumCells(node);
+    while (onePastMaxIndex - minIndex > LEAF_NODE_SEARCH_WINDOW) {
+        uint32_t index = (minIndex + onePastMaxIndex) / 2;
+        if (keys[index] >= key) {
+            onePastMaxIndex = index;
+        } else {
+            minIndex = index + 1;
+        }
+    }
+    return minIndex + countKeysBelow(keys + minIndex, onePastMaxIndex - minIndex, key);
+}
+
+void leafNodeFind(Cursor* cursor, uint32_t pageNum, uint32_t key) {
+    Pager* pager = cursor -> table -> pager;
+    void* node = getPage(pager, pageNum);
+    cursor -> cellNum = leafNodeSearch(node, key);
+    unpinPage(pager, pageNum);
+    cursor -> pageNum = pageNum;
+}
+
+Cursor* createCursor(Table* table) {
+    Cursor* cursor = (Cursor*) malloc(sizeof(Cursor));
+    cursor -> table = table;
+    cursor -> pageNum = table -> rootPageNum;
+    cursor -> cellNum = 0;
+    cursor -> endOfTable = false;
+    cursor -> depth = 0;
+    cursor -> leaf = NULL;
+    return cursor;
+}
+
+/*
+ * Descend from pageNum to the leaf that should hold key, recording the path.
+ * Nodes are latched shared on the way down and a parent is only let go once
+ * its child is latched, so a split is seen either whole or not at all.
+ * Returns the leaf, still latched.
+ */
+void* cursorLatchLeaf(Cursor* cursor, uint32_t pageNum, uint32_t key) {
+    Pager* pager = cursor -> table -> pager;
+    void* node = getPageLatched(pager, pageNum, false);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t childIndex = internalNodeFindChild(node, key);
+        uint32_t childPageNum = *internalNodeChild(node, childIndex);
+        void* child = getPageLatched(pager, childPageNum, false);
+        unlatchPage(pager, node);
+        cursor -> path[cursor -> depth] = pageNum;
+        cursor -> childIndex[cursor -> depth] = childIndex;
+        cursor -> depth++;
+        pageNum = childPageNum;
+        node = child;
+    }
+    cursor -> path[cursor -> depth++] = pageNum;
+    cursor -> pageNum = pageNum;
+    return node;
+}
+
+void cursorDescendToKey(Cursor* cursor, uint32_t pageNum, uint32_t key) {
+    void* leaf = cursorLatchLeaf(cursor, pageNum, key);
+    cursor -> cellNum = leafNodeSearch(leaf, key);
+    unlatchPage(cursor -> table -> pager, leaf);
+}
+
+/*
+ * Descend from pageNum along the first (or last) child of every level,
+ * crabbing as cursorLatchLeaf does. Returns the leaf, still latched.
+ */
+void* cursorDescendToEdge(Cursor* cursor, uint32_t pageNum, bool rightmost) {
+    Pager* pager = cursor -> table -> pager;
+    void* node = getPageLatched(pager, pageNum, false);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t childIndex = rightmost ? *internalNodeNumKeys(node) : 0;
+        uint32_t childPageNum = *internalNodeChild(node, childIndex);
+        void* child = getPageLatched(pager, childPageNum, false);
+        unlatchPage(pager, node);
+        cursor -> path[cursor -> depth] = pageNum;
+        cursor -> childIndex[cursor -> depth] = childIndex;
+        cursor -> depth++;
+        pageNum = childPageNum;
+        node = child;
+    }
+    cursor -> cellNum = rightmost ? *leafNodeNumCells(node) : 0;
+    cursor -> endOfTable = *leafNodeNumCells(node) == 0;
+    cursor -> path[cursor -> depth++] = pageNum;
+    cursor -> pageNum = pageNum;
+    return node;
+}
+
+/*
+ * Return the position of the given key.
+ * If the key is not present, return the position
+ * where it should be inserted
+ */
+Cursor* tableFind(Table* table, uint32_t key) {
+    Cursor* cursor = createCursor(table);
+    cursorDescendToKey(cursor, table -> rootPageNum, key);
+    return cursor;
+}
+
+/*
+ * Reposition the cursor for a key larger than the one it was last placed at.
+ * Ascending keys that land in the same leaf skip the descent from the root.
+ */
+void cursorSeekForward(Cursor* cursor, uint32_t key) {
+    Pager* pager = cursor -> table -> pager;
+    void* node = getPage(pager, cursor -> pageNum);
+    uint32_t numCells = *leafNodeNumCells(node);
+    bool inLeaf = (numCells > 0 && key <= *leafNodeKey(node, numCells - 1)) || *leafNodeNextLeaf(node) == 0;
+    unpinPage(pager, cursor -> pageNum);
+
+    if (inLeaf) {
+        leafNodeFind(cursor, cursor -> pageNum, key);
+        return;
+    }
+    cursor -> depth = 0;
+    cursorDescendToKey(cursor, cursor -> table -> rootPageNum, key);
+}
+
+/*
+ * True when the cursor sits on a cell holding exactly this key.
+ */
+bool cursorMatchesKey(Cursor* cursor, uint32_t key) {
+    void* node = getPageLatched(cursor -> table -> pager, cursor -> pageNum, false);
+    bool matches = cursor -> cellNum < *leafNodeNumCells(node) && *leafNodeKey(node, cursor -> cellNum) == key;
+    unlatchPage(cursor -> table -> pager, node);
+    return matches;
+}
+
+/*
+ * Number of levels from the root down to the leaves, counting both.
+ */
+uint32_t tableHeight(Table* table) {
+    uint32_t height = 1;
+    uint32_t pageNum = table -> rootPageNum;
+    void* node = getPage(table -> pager, pageNum);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t childPageNum = *internalNodeChild(node, 0);
+        unpinPage(table -> pager, pageNum);
+        pageNum = childPageNum;
+        node = getPage(table -> pager, pageNum);
+        height++;
+    }
+    unpinPage(table -> pager, pageNum);
+    return height;
+}
+
+/*
+ * Handle splitting the root.
+ * Old root copied to new page, becomes left child.
+ * Address of right child passed in.
+ * Re-initialize root page to contain the new root node.
+ * New root node points to two children.
+ */
+void createNewRoot(Table* table, uint32_t rightChildPageNum) {
+    Pager* pager = table -> pager;
+    void* root = getPage(pager, table -> rootPageNum);
+    uint32_t leftChildPageNum = getUnusedPageNum(pager);
+    void* leftChild = getPage(pager, leftChildPageNum);
+    markPageDirty(pager, table -> rootPageNum);
+    markPageDirty(pager, leftChildPageNum);
+
+    memcpy(leftChild, root, PAGE_SIZE);
+    setNodeRoot(leftChild, false);
+
+    initializeInternalNode(root);
+    setNodeRoot(root, true);
+    *internalNodeNumKeys(root) = 1;
+    *internalNodeChild(root, 0) = leftChildPageNum;
+    *internalNodeKey(root, 0) = getNodeMaxKey(pager, leftChild);
+    *internalNodeRightChild(root) = rightChildPageNum;
+    *internalNodeRowCount(root, 0) = nodeRowCount(leftChild);
+    *internalNodeRowCount(root, 1) = getPageRowCount(pager, rightChildPageNum);
+
+    unpinPage(pager, leftChildPageNum);
+    unpinPage(pager, table -> rootPageNum);
+    engineStats.rootSplits++;
+}
+
+void internalNodeInsert(Table* table, uint32_t* path, uint32_t level, uint32_t leftChildPageNum, uint32_t childPageNum);
+
+/*
+ * After path[level] was split in two, refresh its separator in the parent and
+ * register the new right sibling there, or grow a new root above it.
+ */
+void insertSplitSibling(Table* table, uint32_t* path, uint32_t level, uint32_t newPageNum) {
+    Pager* pager = table -> pager;
+    uint32_t pageNum = path[level];
+    if (level == 0) {
+        createNewRoot(table, newPageNum);
+        return;
+    }
+
+    uint32_t maxKey = getPageMaxKey(pager, pageNum);
+    uint32_t rowCount = getPageRowCount(pager, pageNum);
+    uint32_t parentPageNum = path[level - 1];
+    void* parent = getPage(pager, parentPageNum);
+    uint32_t index = internalNodeChildIndex(parent, pageNum);
+    markPageDirty(pager, parentPageNum);
+    if (index < *internalNodeNumKeys(parent)) {
+        *internalNodeKey(parent, index) = maxKey;
+    }
+    *internalNodeRowCount(parent, index) = rowCount;
+    unpinPage(pager, parentPageNum);
+    internalNodeInsert(table, path, level - 1, pageNum, newPageNum);
+}
+
+/*
+ * Lay out count children with their keys and row counts in node. The last
+ * child becomes the right child, and its key is dropped.
+ */
+void internalNodeFill(void* node, uint32_t* children, uint32_t* keys, uint32_t* rowCounts, uint32_t count) {
+    *internalNodeNumKeys(node) = count - 1;
+    for (uint32_t i = 0; i < count - 1; i++) {
+        *internalNodeChild(node, i) = children[i];
+        *internalNodeKey(node, i) = keys[i];
+    }
+    *internalNodeRightChild(node) = children[count - 1];
+    for (uint32_t i = 0; i < count; i++) {
+        *internalNodeRowCount(node, i) = rowCounts[i];
+    }
+}
+
+/*
+ * Split a full internal node while adding childPageNum right after leftChildPageNum.
+ * The old node keeps the lower half of the children, a new node takes the upper half.
+ */
+void internalNodeSplitAndInsert(Table* table, uint32_t* path, uint32_t level, uint32_t leftChildPageNum, uint32_t childPageNum) {
+    Pager* pager = table -> pager;
+    uint32_t pageNum = path[level];
+    void* oldNode = getPage(pager, pageNum);
+    uint32_t oldNumKeys = *internalNodeNumKeys(oldNode);
+    uint32_t numEntries = oldNumKeys + 2;
+    engineStats.internalSplits++;
+
+    uint32_t* children = (uint32_t*) malloc(numEntries * sizeof(uint32_t));
+    uint32_t* keys = (uint32_t*) malloc(numEntries * sizeof(uint32_t));
+    uint32_t* rowCounts = (uint32_t*) malloc(numEntries * sizeof(uint32_t));
+
+    uint32_t entry = 0;
+    for (uint32_t i = 0; i <= oldNumKeys; i++) {
+        uint32_t child = *internalNodeChild(oldNode, i);
+        children[entry] = child;
+        keys[entry] = (i < oldNumKeys) ? *internalNodeKey(oldNode, i) : getPageMaxKey(pager, child);
+        rowCounts[entry] = *internalNodeRowCount(oldNode, i);
+        entry++;
+        if (child == leftChildPageNum) {
+            children[entry] = childPageNum;
+            keys[entry] = getPageMaxKey(pager, childPageNum);
+            rowCounts[entry] = getPageRowCount(pager, childPageNum);
+            entry++;
+        }
+    }
+
+    uint32_t newPageNum = getUnusedPageNum(pager);
+    void* newNode = getPage(pager, newPageNum);
+    markPageDirty(pager, pageNum);
+    markPageDirty(pager, newPageNum);
+    initializeInternalNode(newNode);
+
+    uint32_t leftCount = numEntries / 2;
+    uint32_t rightCount = numEntries - leftCount;
+
+    internalNodeFill(oldNode, children, keys, rowCounts, leftCount);
+    internalNodeFill(newNode, children + leftCount, keys + leftCount, rowCounts + leftCount, rightCount);
+
+    free(children);
+    free(keys);
+    free(rowCounts);
+    unpinPage(pager, newPageNum);
+    unpinPage(pager, pageNum);
+
+    insertSplitSibling(table, path, level, newPageNum);
+}
+
+/*
+ * Add a new child/key pair to the internal node at path[level],
+ * placed directly after the child it was split from.
+ */
+void internalNodeInsert(Table* table, uint32_t* path, uint32_t level, uint32_t leftChildPageNum, uint32_t childPageNum) {
+    Pager* pager = table -> pager;
+    uint32_t parentPageNum = path[level];
+    void* parent = getPage(pager, parentPageNum);
+    uint32_t originalNumKeys = *internalNodeNumKeys(parent);
+
+    if (originalNumKeys >= INTERNAL_NODE_MAX_CELLS) {
+        unpinPage(pager, parentPageNum);
+        internalNodeSplitAndInsert(table, path, level, leftChildPageNum, childPageNum);
+        return;
+    }
+
+    uint32_t index = internalNodeChildIndex(parent, leftChildPageNum);
+    markPageDirty(pager, parentPageNum);
+
+    if (index == originalNumKeys) {
+        // Split node was the right child; the new node replaces it there.
+        *internalNodeCell(parent, originalNumKeys) = leftChildPageNum;
+        *internalNodeKey(parent, originalNumKeys) = getPageMaxKey(pager, leftChildPageNum);
+        *internalNodeRightChild(parent) = childPageNum;
+    } else {
+        // Make room for the new cell
+        for (uint32_t i = originalNumKeys; i > index + 1; i--) {
+            memcpy(internalNodeCell(parent, i), internalNodeCell(parent, i - 1), INTERNAL_NODE_CELL_SIZE);
+        }
+        *internalNodeCell(parent, index + 1) = childPageNum;
+        *internalNodeKey(parent, index + 1) = getPageMaxKey(pager, childPageNum);
+    }
+    *internalNodeNumKeys(parent) = originalNumKeys + 1;
+    *internalNodeRowCount(parent, index) = getPageRowCount(pager, leftChildPageNum);
+    *internalNodeRowCount(parent, index + 1) = getPageRowCount(pager, childPageNum);
+    unpinPage(pager, parentPageNum);
+}
+
+/*
+ * Create a new node and move half the bytes over.
+ * Insert the new value in one of the two nodes.
+ * Update parent or create a new parent.
+ */
+void leafNodeSplitAndInsert(Cursor* cursor, uint32_t key, void* newCell, uint32_t newCellSize) {
+    Table* table = cursor -> table;
+    Pager* pager = table -> pager;
+    void* oldNode = getPage(pager, cursor -> pageNum);
+    uint32_t newPageNum = getUnusedPageNum(pager);
+    void* newNode = getPage(pager, newPageNum);
+    markPageDirty(pager, cursor -> pageNum);
+    markPageDirty(pager, newPageNum);
+    engineStats.leafSplits++;
+
+    // Cells are rewritten into both pages from a copy of the old one
+    void* original = malloc(PAGE_SIZE);
+    memcpy(original, oldNode, PAGE_SIZE);
+    uint32_t oldNumCells = *leafNodeNumCells(original);
+
+    uint32_t totalBytes = newCellSize + LEAF_NODE_SLOT_SIZE;
+    for (uint32_t i = 0; i < oldNumCells; i++) {
+        totalBytes += leafNodeCellSize(original, i) + LEAF_NODE_SLOT_SIZE;
+    }
+
+    bool wasRoot = isNodeRoot(oldNode);
+    initializeLeafNode(oldNode);
+    setNodeRoot(oldNode, wasRoot);
+    initializeLeafNode(newNode);
+    *leafNodeNextLeaf(newNode) = *leafNodeNextLeaf(original);
+    *leafNodeNextLeaf(oldNode) = newPageNum;
+
+    /*
+     * The old (left) node fills up to half the bytes, the new (right) node
+     * takes the rest, and each side always gets at least one cell.
+     */
+    void* destinationNode = oldNode;
+    uint32_t leftBytes = 0;
+    for (uint32_t i = 0; i <= oldNumCells; i++) {
+        uint32_t sourceCell = (i < cursor -> cellNum) ? i : i - 1;
+        uint32_t cellSize = (i == cursor -> cellNum) ? newCellSize : leafNodeCellSize(original, sourceCell);
+        if (destinationNode == oldNode && (leftBytes >= totalBytes / 2 || i == oldNumCells)) {
+            destinationNode = newNode;
+        }
+
+        uint32_t cellKey = (i == cursor -> cellNum) ? key : *leafNodeKey(original, sourceCell);
+        void* destination = leafNodeAllocateCell(destinationNode, *leafNodeNumCells(destinationNode), cellKey, cellSize);
+        memcpy(destination, (i == cursor -> cellNum) ? newCell : leafNodeCell(original, sourceCell), cellSize);
+        leftBytes += cellSize + LEAF_NODE_SLOT_SIZE;
+    }
+
+    free(original);
+    unpinPage(pager, newPageNum);
+    unpinPage(pager, cursor -> pageNum);
+
+    insertSplitSibling(table, cursor -> path, cursor -> depth - 1, newPageNum);
+}
+
+/*
+ * Latch exclusively every node an insert of cellSize bytes at the cursor can
+ * change: the leaf and, if it has to split, each ancestor up to the first one
+ * with room for another key. Latches are taken top-down, the same order
+ * readers crab in. Only one thread ever changes the tree, so the unlatched
+ * look at the path beforehand can't go stale. Returns the highest latched
+ * level; latched[level] holds the page of path[level] from there down.
+ */
+uint32_t cursorLatchForInsert(Cursor* cursor, uint32_t cellSize, void** latched) {
+    Pager* pager = cursor -> table -> pager;
+    uint32_t top = cursor -> depth - 1;
+    void* leaf = getPage(pager, cursor -> pageNum);
+    bool splits = leafNodeFreeSpace(leaf) < cellSize + LEAF_NODE_SLOT_SIZE;
+    unpinPage(pager, cursor -> pageNum);
+    while (splits && top > 0) {
+        top--;
+        void* node = getPage(pager, cursor -> path[top]);
+        splits = *internalNodeNumKeys(node) >= INTERNAL_NODE_MAX_CELLS;
+        unpinPage(pager, cursor -> path[top]);
+    }
+
+    for (uint32_t level = top; level < cursor -> depth; level++) {
+        latched[level] = getPageLatched(pager, cursor -> path[level], true);
+    }
+    return top;
+}
+
+/*
+ * Add delta to the row counts on the path to the cursor's leaf, including the
+ * levels above the latched ones. An insert counts its row before it goes in
+ * and a delete before it comes out, so the splits and merges below recompute
+ * counts that already agree with the leaves.
+ */
+void cursorCountRows(Cursor* cursor, int32_t delta) {
+    Pager* pager = cursor -> table -> pager;
+    for (uint32_t level = 0; level + 1 < cursor -> depth; level++) {
+        uint32_t pageNum = cursor -> path[level];
+        void* node = getPage(pager, pageNum);
+        uint32_t child = cursor -> childIndex[level];
+        if (child > *internalNodeNumKeys(node) || *internalNodeChild(node, child) != cursor -> path[level + 1]) {
+            child = internalNodeChildIndex(node, cursor -> path[level + 1]);
+        }
+        markPageDirty(pager, pageNum);
+        __atomic_fetch_add(internalNodeRowCount(node, child), (uint32_t) delta, __ATOMIC_RELAXED);
+        unpinPage(pager, pageNum);
+    }
+}
+
+/*
+ * Insert key with an already built cell at the cursor.
+ * Returns true if the leaf had to split, which leaves the cursor's path stale.
+ */
+bool leafNodeInsertCell(Cursor* cursor, uint32_t key, void* cell, uint32_t cellSize) {
+    Pager* pager = cursor -> table -> pager;
+    void* latched[BTREE_MAX_DEPTH];
+    uint32_t top = cursorLatchForInsert(cursor, cellSize, latched);
+    cursorCountRows(cursor, 1);
+    void* node = latched[cursor -> depth - 1];
+    bool split = leafNodeFreeSpace(node) < cellSize + LEAF_NODE_SLOT_SIZE;
+    if (split) {
+        leafNodeSplitAndInsert(cursor, key, cell, cellSize);
+    } else {
+        markPageDirty(pager, cursor -> pageNum);
+        memcpy(leafNodeAllocateCell(node, cursor -> cellNum, key, cellSize), cell, cellSize);
+    }
+
+    for (uint32_t level = top; level < cursor -> depth; level++) {
+        unlatchPage(pager, latched[level]);
+    }
+    return split;
+}
+
+bool leafNodeInsert(Cursor* cursor, uint32_t key, Row* value) {
+    uint8_t cell[LEAF_NODE_MAX_CELL_SIZE];
+    serializeRow(value, cell);
+    return leafNodeInsertCell(cursor, key, cell, rowCellSize(value));
+}
+
+/*
+ * Replace the row under the cursor with value, keeping its id. If the new
+ * cell fits in the old one plus the leaf's free space it is rewritten where it
+ * is, so only the leaf is latched and dirtied; one of the same size leaves
+ * every other byte of the page alone. Otherwise the old cell comes out and the
+ * new one goes in at its place, splitting the leaf. Returns true if the leaf
+ * split, which leaves the cursor's path stale.
+ */
+bool leafNodeUpdate(Cursor* cursor, Row* value) {
+    Pager* pager = cursor -> table -> pager;
+    uint8_t cell[LEAF_NODE_MAX_CELL_SIZE];
+    uint32_t cellSize = rowCellSize(value);
+    serializeRow(value, cell);
+
+    void* leaf = getPage(pager, cursor -> pageNum);
+    bool inPlace = cellSize <= leafNodeCellSize(leaf, cursor -> cellNum) + leafNodeFreeSpace(leaf);
+    unpinPage(pager, cursor -> pageNum);
+    if (inPlace) {
+        void* node = getPageLatched(pager, cursor -> pageNum, true);
+        markPageDirty(pager, cursor -> pageNum);
+        memcpy(leafNodeResizeCell(node, cursor -> cellNum, cellSize), cell, cellSize);
+        unlatchPage(pager, node);
+        engineStats.updatesInPlace++;
+        return false;
+    }
+
+    // Too big for the leaf even without the old cell, so the insert always splits
+    void* latched[BTREE_MAX_DEPTH];
+    uint32_t top = cursorLatchForInsert(cursor, cellSize, latched);
+    uint32_t key = *leafNodeKey(latched[cursor -> depth - 1], cursor -> cellNum);
+    markPageDirty(pager, cursor -> pageNum);
+    leafNodeRemoveCell(latched[cursor -> depth - 1], cursor -> cellNum);
+    leafNodeSplitAndInsert(cursor, key, cell, cellSize);
+    for (uint32_t level = top; level < cursor -> depth; level++) {
+        unlatchPage(pager, latched[level]);
+    }
+    engineStats.updatesRelocated++;
+    return true;
+}
+
+/*
+ * The neighbour the child at index borrows from or merges with: the next
+ * child of the same parent, or the previous one for the right child.
+ */
+uint32_t internalNodeSiblingIndex(void* parent, uint32_t index) {
+    return index < *internalNodeNumKeys(parent) ? index + 1 : index - 1;
+}
+
+bool nodeUnderfull(void* node) {
+    if (getNodeType(node) == NODE_LEAF) {
+        return leafNodeUsedSpace(node) < LEAF_NODE_MIN_FILL;
+    }
+    return *internalNodeNumKeys(node) + 1 < INTERNAL_NODE_MIN_CHILDREN;
+}
+
+/*
+ * Move cells between two neighbouring leaves: all of right's into left for a
+ * merge, otherwise until each holds about half the bytes. Both are rebuilt
+ * from copies, the way a split rebuilds its halves.
+ */
+void leafNodeRedistribute(void* left, void* right, bool merge) {
+    void* originalLeft = malloc(PAGE_SIZE);
+    void* originalRight = malloc(PAGE_SIZE);
+    memcpy(originalLeft, left, PAGE_SIZE);
+    memcpy(originalRight, right, PAGE_SIZE);
+    uint32_t leftCells = *leafNodeNumCells(originalLeft);
+    uint32_t totalCells = leftCells + *leafNodeNumCells(originalRight);
+    uint32_t totalBytes = leafNodeUsedSpace(originalLeft) + leafNodeUsedSpace(originalRight);
+
+    initializeLeafNode(left);
+    if (merge) {
+        *leafNodeNextLeaf(left) = *leafNodeNextLeaf(originalRight);
+    } else {
+        *leafNodeNextLeaf(left) = *leafNodeNextLeaf(originalLeft);
+        initializeLeafNode(right);
+        *leafNodeNextLeaf(right) = *leafNodeNextLeaf(originalRight);
+    }
+
+    void* destinationNode = left;
+    uint32_t leftBytes = 0;
+    for (uint32_t i = 0; i < totalCells; i++) {
+        void* source = (i < leftCells) ? originalLeft : originalRight;
+        uint32_t sourceCell = (i < leftCells) ? i : i - leftCells;
+        uint32_t cellSize = leafNodeCellSize(source, sourceCell);
+        if (!merge && destinationNode == left && (leftBytes >= totalBytes / 2 || i == totalCells - 1)) {
+            destinationNode = right;
+        }
+
+        void* destination = leafNodeAllocateCell(destinationNode, *leafNodeNumCells(destinationNode),
+                                                  *leafNodeKey(source, sourceCell), cellSize);
+        memcpy(destination, leafNodeCell(source, sourceCell), cellSize);
+        leftBytes += cellSize + LEAF_NODE_SLOT_SIZE;
+    }
+
+    free(originalLeft);
+    free(originalRight);
+}
+
+/*
+ * The same for two neighbouring internal nodes. separator is the parent's key
+ * for left, which bounds left's right child. Returns the key the parent
+ * should hold for left afterwards.
+ */
+uint32_t internalNodeRedistribute(void* left, void* right, uint32_t separator, bool merge) {
+    uint32_t leftKeys = *internalNodeNumKeys(left);
+    uint32_t rightKeys = *internalNodeNumKeys(right);
+    uint32_t numEntries = leftKeys + rightKeys + 2;
+    uint32_t* children = (uint32_t*) malloc(numEntries * sizeof(uint32_t));
+    uint32_t* keys = (uint32_t*) malloc(numEntries * sizeof(uint32_t));
+    uint32_t* rowCounts = (uint32_t*) malloc(numEntries * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i <= leftKeys; i++) {
+        children[i] = *internalNodeChild(left, i);
+        keys[i] = (i < leftKeys) ? *internalNodeKey(left, i) : separator;
+        rowCounts[i] = *internalNodeRowCount(left, i);
+    }
+    for (uint32_t i = 0; i <= rightKeys; i++) {
+        uint32_t entry = leftKeys + 1 + i;
+        children[entry] = *internalNodeChild(right, i);
+        keys[entry] = (i < rightKeys) ? *internalNodeKey(right, i) : 0;
+        rowCounts[entry] = *internalNodeRowCount(right, i);
+    }
+
+    uint32_t leftCount = merge ? numEntries : numEntries / 2;
+    internalNodeFill(left, children, keys, rowCounts, leftCount);
+    if (!merge) {
+        internalNodeFill(right, children + leftCount, keys + leftCount, rowCounts + leftCount, numEntries - leftCount);
+    }
+    uint32_t newSeparator = keys[leftCount - 1];
+
+    free(children);
+    free(keys);
+    free(rowCounts);
+    return newSeparator;
+}
+
+/*
+ * Drop child index, whose contents were merged into the child before it. That
+ * child takes over the dropped one's key, or becomes the right child.
+ */
+void internalNodeRemoveChild(void* node, uint32_t index) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    if (index == numKeys) {
+        *internalNodeRightChild(node) = *internalNodeCell(node, index - 1);
+    } else {
+        *internalNodeKey(node, index - 1) = *internalNodeKey(node, index);
+        memmove(internalNodeCell(node, index), internalNodeCell(node, index + 1), (numKeys - index - 1) * INTERNAL_NODE_CELL_SIZE);
+    }
+    *internalNodeNumKeys(node) = numKeys - 1;
+}
+
+/*
+ * Even out the child at index of parent with its sibling, or merge the two if
+ * they fit in one node. The left node of a pair always survives a merge, and
+ * the right one's page goes on the free list. All three are latched
+ * exclusively. Returns true on a merge, which leaves the parent a child short.
+ */
+bool internalNodeRebalanceChild(Pager* pager, uint32_t parentPageNum, void* parent, uint32_t index, void* child,
+                                uint32_t siblingIndex, void* sibling) {
+    uint32_t leftIndex = siblingIndex < index ? siblingIndex : index;
+    void* left = siblingIndex < index ? sibling : child;
+    void* right = siblingIndex < index ? child : sibling;
+    uint32_t leftPageNum = *internalNodeChild(parent, leftIndex);
+    uint32_t rightPageNum = *internalNodeChild(parent, leftIndex + 1);
+    markPageDirty(pager, parentPageNum);
+    markPageDirty(pager, leftPageNum);
+    markPageDirty(pager, rightPageNum);
+
+    bool merge;
+    uint32_t separator = 0;
+    if (getNodeType(left) == NODE_LEAF) {
+        merge = leafNodeUsedSpace(left) + leafNodeUsedSpace(right) <= LEAF_NODE_SPACE_FOR_CELLS;
+        leafNodeRedistribute(left, right, merge);
+        if (!merge) {
+            separator = *leafNodeKey(left, *leafNodeNumCells(left) - 1);
+        }
+    } else {
+        merge = *internalNodeNumKeys(left) + *internalNodeNumKeys(right) + 2 <= INTERNAL_NODE_MAX_CELLS + 1;
+        separator = internalNodeRedistribute(left, right, *internalNodeKey(parent, leftIndex), merge);
+    }
+
+    if (merge) {
+        internalNodeRemoveChild(parent, leftIndex + 1);
+        *internalNodeRowCount(parent, leftIndex) = nodeRowCount(left);
+        freeListPush(pager, rightPageNum);
+        engineStats.nodeMerges++;
+    } else {
+        *internalNodeKey(parent, leftIndex) = separator;
+        *internalNodeRowCount(parent, leftIndex) = nodeRowCount(left);
+        *internalNodeRowCount(parent, leftIndex + 1) = nodeRowCount(right);
+        engineStats.nodeRedistributions++;
+    }
+    return merge;
+}
+
+/*
+ * A root left with a single child takes the child's place and the tree loses
+ * a level. The root keeps its page, so the child is copied up and its page
+ * freed. Both are latched exclusively.
+ */
+void collapseRoot(Pager* pager, uint32_t rootPageNum, void* root) {
+    uint32_t childPageNum = *internalNodeRightChild(root);
+    void* child = getPage(pager, childPageNum);
+    uint32_t catalog = *((uint32_t*) (root + ROOT_CATALOG_PAGE_OFFSET));
+    markPageDirty(pager, rootPageNum);
+    memcpy(root, child, PAGE_SIZE);
+    setNodeRoot(root, true);
+    // On page 0 the parent pointer holds the catalog page
+    *((uint32_t*) (root + ROOT_CATALOG_PAGE_OFFSET)) = catalog;
+    unpinPage(pager, childPageNum);
+    freeListPush(pager, childPageNum);
+    engineStats.rootCollapses++;
+}
+
+/*
+ * Latch exclusively every node removing numCells cells at the cursor can
+ * change: the leaf and, if it ends up underfull, its parent and the sibling
+ * it will merge with or borrow from, then each ancestor a merge below could
+ * leave underfull in turn. As for inserts, the path is looked at unlatched
+ * first and latched top-down; if the leaf may merge, the catalog that holds
+ * the free list is created before anything is latched. A left sibling is
+ * latched before the leaf, the order readers walk the leaves in, and stored
+ * in *sibling; siblings further up are latched once needed, under their
+ * latched parent. Returns the highest latched level.
+ */
+uint32_t cursorLatchForDelete(Cursor* cursor, uint32_t numCells, void** latched, void** sibling) {
+    Pager* pager = cursor -> table -> pager;
+    uint32_t leafLevel = cursor -> depth - 1;
+    uint32_t top = leafLevel;
+    void* leaf = getPage(pager, cursor -> pageNum);
+    uint32_t usedSpace = leafNodeUsedSpace(leaf);
+    for (uint32_t i = 0; i < numCells; i++) {
+        usedSpace -= leafNodeCellSize(leaf, cursor -> cellNum + i) + LEAF_NODE_SLOT_SIZE;
+    }
+    unpinPage(pager, cursor -> pageNum);
+    bool underfull = usedSpace < LEAF_NODE_MIN_FILL;
+    while (underfull && top > 0) {
+        top--;
+        void* node = getPage(pager, cursor -> path[top]);
+        underfull = *internalNodeNumKeys(node) < INTERNAL_NODE_MIN_CHILDREN;
+        unpinPage(pager, cursor -> path[top]);
+    }
+    if (top < leafLevel) {
+        // A merge frees a page onto the list in the catalog, which can't be created under tree latches
+        catalogCreate(pager);
+    }
+
+    for (uint32_t level = top; level < leafLevel; level++) {
+        latched[level] = getPageLatched(pager, cursor -> path[level], true);
+    }
+    *sibling = NULL;
+    uint32_t siblingPageNum = 0;
+    bool siblingLeft = false;
+    if (top < leafLevel) {
+        void* parent = latched[leafLevel - 1];
+        if (*internalNodeNumKeys(parent) > 0) {
+            uint32_t index = internalNodeChildIndex(parent, cursor -> pageNum);
+            uint32_t siblingIndex = internalNodeSiblingIndex(parent, index);
+            siblingPageNum = *internalNodeChild(parent, siblingIndex);
+            siblingLeft = siblingIndex < index;
+        }
+    }
+    if (siblingPageNum != 0 && siblingLeft) {
+        *sibling = getPageLatched(pager, siblingPageNum, true);
+    }
+    latched[leafLevel] = getPageLatched(pager, cursor -> pageNum, true);
+    if (siblingPageNum != 0 && !siblingLeft) {
+        *sibling = getPageLatched(pager, siblingPageNum, true);
+    }
+    return top;
+}
+
+/*
+ * Remove numCells cells from the cursor's leaf, starting at the cursor, then
+ * rebalance from the leaf up: an underfull node merges with or borrows from a
+ * sibling, and a merge that leaves the parent underfull carries on there.
+ * The cursor's path is stale afterwards.
+ */
+void leafNodeDelete(Cursor* cursor, uint32_t numCells) {
+    Pager* pager = cursor -> table -> pager;
+    void* latched[BTREE_MAX_DEPTH];
+    void* siblings[BTREE_MAX_DEPTH] = { NULL };
+    uint32_t leafLevel = cursor -> depth - 1;
+    uint32_t top = cursorLatchForDelete(cursor, numCells, latched, &(siblings[leafLevel]));
+    cursorCountRows(cursor, -(int32_t) numCells);
+    markPageDirty(pager, cursor -> pageNum);
+    for (uint32_t i = 0; i < numCells; i++) {
+        leafNodeRemoveCell(latched[leafLevel], cursor -> cellNum);
+    }
+
+    uint32_t level = leafLevel;
+    while (level > top && nodeUnderfull(latched[level])) {
+        void* parent = latched[level - 1];
+        if (*internalNodeNumKeys(parent) == 0) {
+            break;
+        }
+        uint32_t index = internalNodeChildIndex(parent, cursor -> path[level]);
+        uint32_t siblingIndex = internalNodeSiblingIndex(parent, index);
+        if (siblings[level] == NULL) {
+            siblings[level] = getPageLatched(pager, *internalNodeChild(parent, siblingIndex), true);
+        }
+        if (!internalNodeRebalanceChild(pager, cursor -> path[level - 1], parent, index, latched[level], siblingIndex,
+                                        siblings[level])) {
+            break;
+        }
+        level--;
+    }
+    if (level == 0 && getNodeType(latched[0]) == NODE_INTERNAL && *internalNodeNumKeys(latched[0]) == 0) {
+        collapseRoot(pager, cursor -> path[0], latched[0]);
+    }
+
+    for (level = top; level <= leafLevel; level++) {
+        unlatchPage(pager, latched[level]);
+        if (siblings[level] != NULL) {
+            unlatchPage(pager, siblings[level]);
+        }
+    }
+}
+
+/*
+ * Move the cursor and its path on to the start of the next leaf, going up to
+ * the nearest ancestor with a child further right and back down that child's
+ * left edge. Returns false past the last leaf.
+ */
+bool cursorStepLeaf(Cursor* cursor) {
+    Pager* pager = cursor -> table -> pager;
+    for (uint32_t level = cursor -> depth - 1; level > 0; level--) {
+        uint32_t pageNum = cursor -> path[level - 1];
+        void* node = getPageLatched(pager, pageNum, false);
+        uint32_t childIndex = internalNodeChildIndex(node, cursor -> path[level]) + 1;
+        bool hasNext = childIndex <= *internalNodeNumKeys(node);
+        uint32_t childPageNum = hasNext ? *internalNodeChild(node, childIndex) : 0;
+        unlatchPage(pager, node);
+        if (hasNext) {
+            cursor -> childIndex[level - 1] = childIndex;
+            cursor -> depth = level;
+            unlatchPage(pager, cursorDescendToEdge(cursor, childPageNum, false));
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Keys in a separator but past a leaf's last cell can leave a cursor from
+ * tableFind at the end of its leaf. Move it and its path on to the next row;
+ * returns false if there is none.
+ */
+bool cursorSkipLeafEnd(Cursor* cursor) {
+    Pager* pager = cursor -> table -> pager;
+    for (;;) {
+        void* node = getPageLatched(pager, cursor -> pageNum, false);
+        bool onRow = cursor -> cellNum < *leafNodeNumCells(node);
+        unlatchPage(pager, node);
+        if (onRow) {
+            return true;
+        }
+        if (!cursorStepLeaf(cursor)) {
+            return false;
+        }
+    }
+}
+
+/*
+ * Number of cells from the cursor to the end of its leaf whose keys are at
+ * most high.
+ */
+uint32_t cursorCellsUpTo(Cursor* cursor, uint32_t high) {
+    void* node = getPageLatched(cursor -> table -> pager, cursor -> pageNum, false);
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint32_t end = cursor -> cellNum;
+    while (end < numCells && *leafNodeKey(node, end) <= high) {
+        end++;
+    }
+    unlatchPage(cursor -> table -> pager, node);
+    return end - cursor -> cellNum;
+}
+
+/*
+ * Position a cursor on the first row. Like tableSeek, the leaf stays latched
+ * until the first cursorNextBatch takes it over.
+ */
+Cursor* tableStart(Table* table) {
+    Cursor* cursor = createCursor(table);
+    void* node = cursorDescendToEdge(cursor, table -> rootPageNum, false);
+    if (cursor -> endOfTable) {
+        unlatchPage(table -> pager, node);
+    } else {
+        cursor -> leaf = node;
+    }
+    return cursor;
+}
+
+Cursor* tableEnd(Table* table) {
+    Cursor* cursor = createCursor(table);
+    unlatchPage(table -> pager, cursorDescendToEdge(cursor, table -> rootPageNum, true));
+    cursor -> endOfTable = true;
+    return cursor;
+}
+
+void leafNodeRow(void* node, uint32_t cellNum, Row* destination) {
+    destination -> id = *leafNodeKey(node, cellNum);
+    deserializeRow(leafNodeCell(node, cellNum), destination);
+    statsAdd(&(engineStats.rowsScanned), 1);
+}
+
+/*
+ * Copy the row under the cursor out of its page.
+ */
+void cursorRow(Cursor* cursor, Row* destination) {
+    void* page = getPageLatched(cursor -> table -> pager, cursor -> pageNum, false);
+    leafNodeRow(page, cursor -> cellNum, destination);
+    unlatchPage(cursor -> table -> pager, page);
+}
+
+/*
+ * Step to the next cell, following the sibling link once the leaf runs out.
+ * The next leaf is latched before the current one is let go.
+ */
+void cursorAdvance(Cursor* cursor) {
+    Pager* pager = cursor -> table -> pager;
+    void* node = getPageLatched(pager, cursor -> pageNum, false);
+    cursor -> cellNum += 1;
+    while (cursor -> cellNum >= *leafNodeNumCells(node)) {
+        uint32_t nextPageNum = *leafNodeNextLeaf(node);
+        if (nextPageNum == 0) {
+            unlatchPage(pager, node);
+            cursor -> endOfTable = true;
+            return;
+        }
+        void* next = getPageLatched(pager, nextPageNum, false);
+        unlatchPage(pager, node);
+        node = next;
+        cursor -> pageNum = nextPageNum;
+        cursor -> cellNum = 0;
+    }
+    unlatchPage(pager, node);
+}
+
+void rowBatchRelease(Pager* pager, RowBatch* batch) {
+    if (batch -> page != NULL) {
+        unlatchPage(pager, batch -> page);
+        batch -> page = NULL;
+    }
+    batch -> numRows = 0;
+}
+
+/*
+ * Fill batch with the rest of the cursor's leaf and move the cursor on to the
+ * next leaf. The leaf is latched once for the whole batch instead of once per
+ * row, and the previous batch's leaf is only let go once the next one is
+ * latched; the first batch takes over the leaf tableSeek or tableStart left
+ * latched. Returns false once the table is exhausted. The batch must start
+ * out released and be released by the caller when done.
+ */
+bool cursorNextBatch(Cursor* cursor, RowBatch* batch) {
+    Pager* pager = cursor -> table -> pager;
+    void* previous = batch -> page;
+    batch -> page = NULL;
+    batch -> numRows = 0;
+    while (!(cursor -> endOfTable)) {
+        void* node = cursor -> leaf != NULL ? cursor -> leaf : getPageLatched(pager, cursor -> pageNum, false);
+        cursor -> leaf = NULL;
+        if (previous != NULL) {
+            unlatchPage(pager, previous);
+            previous = NULL;
+        }
+        uint32_t numCells = *leafNodeNumCells(node);
+        // A split since the last batch can leave the cursor past the end of its leaf
+        uint32_t start = cursor -> cellNum < numCells ? cursor -> cellNum : numCells;
+        uint32_t end = numCells;
+        if (end - start > ROW_BATCH_SIZE) {
+            end = start + ROW_BATCH_SIZE;
+        }
+
+        uint32_t numRows = 0;
+        memcpy(batch -> ids, leafNodeKey(node, start), (end - start) * LEAF_NODE_KEY_SIZE);
+        for (uint32_t i = start; i < end; i++) {
+            uint8_t* value = (uint8_t*) leafNodeCell(node, i);
+            batch -> usernameLengths[numRows] = value[0];
+            batch -> usernames[numRows] = (const char*) value + LEAF_NODE_STRING_LENGTH_SIZE;
+            value += LEAF_NODE_STRING_LENGTH_SIZE + value[0];
+            batch -> emailLengths[numRows] = value[0];
+            batch -> emails[numRows] = (const char*) value + LEAF_NODE_STRING_LENGTH_SIZE;
+            numRows++;
+        }
+
+        if (end < numCells) {
+            cursor -> cellNum = end;
+        } else if (*leafNodeNextLeaf(node) == 0) {
+            cursor -> endOfTable = true;
+        } else {
+            cursor -> pageNum = *leafNodeNextLeaf(node);
+            cursor -> cellNum = 0;
+        }
+
+        if (numRows > 0) {
+            statsAdd(&(engineStats.rowsScanned), numRows);
+            batch -> numRows = numRows;
+            batch -> page = node;
+            return true;
+        }
+        unlatchPage(pager, node);
+    }
+    if (previous != NULL) {
+        unlatchPage(pager, previous);
+    }
+    return false;
+}
+
+/*
+ * Position a cursor on the first row whose id is at least key. The leaf
+ * stays latched until the first cursorNextBatch takes it over, so the writer
+ * can't move the cells out from under cellNum in between; call that next.
+ */
+Cursor* tableSeek(Table* table, uint32_t key) {
+    Pager* pager = table -> pager;
+    Cursor* cursor = createCursor(table);
+    void* node = cursorLatchLeaf(cursor, table -> rootPageNum, key);
+    cursor -> cellNum = leafNodeSearch(node, key);
+    if (cursor -> cellNum >= *leafNodeNumCells(node)) {
+        // The key is past the leaf's last cell but within its separator; step off its end
+        uint32_t nextPageNum = *leafNodeNextLeaf(node);
+        if (nextPageNum == 0) {
+            cursor -> endOfTable = true;
+            unlatchPage(pager, node);
+            return cursor;
+        }
+        void* next = getPageLatched(pager, nextPageNum, false);
+        unlatchPage(pager, node);
+        node = next;
+        cursor -> pageNum = nextPageNum;
+        cursor -> cellNum = 0;
+    }
+    cursor -> leaf = node;
+    return cursor;
+}
+
+/*
+ * Copy out the row with this id. Returns false if there is none. The leaf
+ * stays latched from the search through the copy.
+ */
+bool tableFindRow(Table* table, uint32_t id, Row* row) {
+    Cursor* cursor = createCursor(table);
+    void* node = cursorLatchLeaf(cursor, table -> rootPageNum, id);
+    uint32_t cellNum = leafNodeSearch(node, id);
+    bool found = cellNum < *leafNodeNumCells(node) && *leafNodeKey(node, cellNum) == id;
+    if (found) {
+        leafNodeRow(node, cellNum, row);
+    }
+    unlatchPage(table -> pager, node);
+    free(cursor);
+    return found;
+}
+
+/*
+ * Number of keys in the tree below key, added up from the row counts of the
+ * subtrees left of the path down to key plus the leaf cells before it. No
+ * row is read.
+ */
+uint32_t tableRank(Table* table, uint32_t key) {
+    Pager* pager = table -> pager;
+    void* node = getPageLatched(pager, table -> rootPageNum, false);
+    uint32_t rank = 0;
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t childIndex = internalNodeFindChild(node, key);
+        for (uint32_t i = 0; i < childIndex; i++) {
+            rank += __atomic_load_n(internalNodeRowCount(node, i), __ATOMIC_RELAXED);
+        }
+        void* child = getPageLatched(pager, *internalNodeChild(node, childIndex), false);
+        unlatchPage(pager, node);
+        node = child;
+    }
+    rank += leafNodeSearch(node, key);
+    unlatchPage(pager, node);
+    return rank;
+}
+
+uint32_t tableRowCount(Table* table) {
+    void* root = getPageLatched(table -> pager, table -> rootPageNum, false);
+    uint32_t rowCount = nodeRowCount(root);
+    unlatchPage(table -> pager, root);
+    return rowCount;
+}
+
+/*
+ * The key with rank keys below it, which must be less than the row count.
+ * Counts bumped ahead of an insert still in flight can point one past a
+ * leaf's last cell, so the leaf position is clamped.
+ */
+uint32_t tableKeyAtRank(Table* table, uint32_t rank) {
+    Pager* pager = table -> pager;
+    void* node = getPageLatched(pager, table -> rootPageNum, false);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t numKeys = *internalNodeNumKeys(node);
+        uint32_t childIndex = 0;
+        for (; childIndex < numKeys; childIndex++) {
+            uint32_t rowCount = __atomic_load_n(internalNodeRowCount(node, childIndex), __ATOMIC_RELAXED);
+            if (rank < rowCount) {
+                break;
+            }
+            rank -= rowCount;
+        }
+        void* child = getPageLatched(pager, *internalNodeChild(node, childIndex), false);
+        unlatchPage(pager, node);
+        node = child;
+    }
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint32_t key = *leafNodeKey(node, rank < numCells ? rank : numCells - 1);
+    unlatchPage(pager, node);
+    return key;
+}
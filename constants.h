@@ -1,10 +1,40 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
-#define TABLE_MAX_PAGES 100
+#define DEFAULT_POOL_FRAMES 1024
+#define MIN_POOL_FRAMES 64
+#define BTREE_MAX_DEPTH 16
+#define ROW_BATCH_SIZE 512
+#define LEAF_NODE_SEARCH_WINDOW 32
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define INPUT_BUFFER_SIZE (1 << 20)
+#define MMAP_RESERVE_SIZE (1ULL << 36)
+#define MMAP_MIN_GROWTH_PAGES 256
+#define URING_ENTRIES 128
+#define PAGER_READAHEAD_PAGES 32
+#define PAGER_WRITE_SLOTS 32
+#define PAGER_IO_WRITE (1ULL << 32)
+#define WAL_GROUP_COMMIT_SIZE 64
+#define STATS_LATENCY_BUCKETS 24
+#define SCAN_MAX_THREADS 64
+#define SCAN_MORSELS_PER_THREAD 8
+#define WAL_CHECKPOINT_FRAMES 4096
+#define WAL_MAGIC 0x4c41574eu
+#define WAL_VERSION 1
+#define IMPORT_DEFAULT_FILL_PERCENT 90
+#define IMPORT_RUN_ROWS 131072
+#define IMPORT_WRITE_BATCH_PAGES 256
+#define IMPORT_READ_BUFFER_SIZE (1 << 20)
+#define IMPORT_RUN_BUFFER_SIZE (1 << 16)
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE (1 << 16)
+#define SERVER_MAX_REQUEST_SIZE (64 << 20)
+#define SERVER_MAX_QUEUED_OUTPUT (8 << 20)
 #define sizeOfAttribute(Struct, Attribute) sizeof(((Struct*)0) -> Attribute)
 
 
@@ -23,18 +53,41 @@ typedef enum {
 
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_DELETE,
+    STATEMENT_UPDATE,
+    STATEMENT_SELECT,
+    STATEMENT_BEGIN,
+    STATEMENT_COMMIT,
+    STATEMENT_ROLLBACK,
+    STATEMENT_CREATE_INDEX,
+    NUM_STATEMENT_TYPES
 } StatementType;
 
 
 typedef enum {
     EXECUTE_SUCCESS,
-    EXECUTE_TABLE_FULL
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_TRANSACTION_ACTIVE,
+    EXECUTE_NO_TRANSACTION,
+    EXECUTE_TRANSACTION_FULL,
+    EXECUTE_TRANSACTIONS_UNSUPPORTED,
+    EXECUTE_INDEX_EXISTS,
+    EXECUTE_INDEX_IN_TRANSACTION
 } ExecuteResult;
 
+/*
+ * Input is read in large chunks into data and split into lines there;
+ * buffer points at the current line inside it. data[start, end) is what has
+ * been read but not handed out yet.
+ */
 typedef struct {
+    int fileDescriptor;
+    char* data;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    bool endOfInput;
     char* buffer;
-    size_t bufferLength;
     ssize_t inputLength;
 } InputBuffer;
 
@@ -44,42 +97,313 @@ typedef struct {
     char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+/*
+ * The string columns, which are the ones that can be indexed.
+ */
+typedef enum {
+    COLUMN_USERNAME,
+    COLUMN_EMAIL,
+    NUM_INDEXABLE_COLUMNS
+} Column;
+
+typedef enum {
+    TOKEN_WORD,
+    TOKEN_NUMBER,
+    TOKEN_STRING,
+    TOKEN_SYMBOL,
+    TOKEN_END,
+    TOKEN_ERROR
+} TokenType;
+
+typedef struct {
+    TokenType type;
+    char* start;
+    uint32_t length;
+} Token;
+
+typedef struct {
+    char* input;
+    size_t position;
+} Lexer;
+
+typedef enum {
+    AGGREGATE_NONE,
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_SUM
+} Aggregate;
+
+/*
+ * Partial or final result of an aggregate over ids. min and max only mean
+ * something once count is above zero.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+} AggregateState;
+
+/*
+ * rows is reused from statement to statement and only grows.
+ */
 typedef struct {
     StatementType type;
-    Row rowToInsert;
+    Row* rows;
+    uint32_t numRows;
+    uint32_t rowCapacity;
+    bool hasIdRange;
+    uint32_t idLow;
+    uint32_t idHigh;
+    bool hasValueMatch;
+    Column column;
+    char value[COLUMN_EMAIL_SIZE + 1];
+    Aggregate aggregate;
+    bool assigns[NUM_INDEXABLE_COLUMNS];
+    Row assigned;
 } Statement;
 
+typedef enum {
+    PAGER_POOL,
+    PAGER_MMAP
+} PagerMode;
+
+typedef struct {
+    PagerMode mode;
+    uint32_t numFrames;
+    uint32_t groupCommitSize;
+    uint32_t readaheadPages;
+    bool syncIo;
+} PagerOptions;
+
+/*
+ * One slot of the buffer pool. A frame is only evictable while nobody has it pinned.
+ * pinCount is only raised under the pager lock but may drop without it, so it
+ * is always accessed atomically. latch guards the page contents: readers hold
+ * it shared, the writer exclusively while it changes the page.
+ */
+typedef struct {
+    uint32_t pageNum;
+    uint32_t pinCount;
+    pthread_rwlock_t latch;
+    bool valid;
+    bool referenced;
+    bool dirty;
+    bool uncommitted;
+    bool loading;
+    int32_t hashNext;
+    void* data;
+} Frame;
+
+/*
+ * An io_uring instance driven through the raw system calls, with its
+ * submission and completion rings mapped in. fileDescriptor is -1 when the
+ * kernel doesn't offer io_uring.
+ */
+typedef struct {
+    int fileDescriptor;
+    uint32_t entries;
+    uint32_t unsubmitted;
+    uint32_t inFlight;
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t sqMask;
+    uint32_t* sqArray;
+    void* sqes;
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t cqMask;
+    void* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} Uring;
+
+/*
+ * Write-ahead log next to the database file. Commits are appended as page
+ * images and only fsynced once per group.
+ */
+typedef struct {
+    int fileDescriptor;
+    uint32_t salt;
+    uint64_t length;
+    uint32_t framesSinceCheckpoint;
+    uint32_t pendingCommits;
+    uint32_t groupCommitSize;
+    void* buffer;
+    size_t bufferCapacity;
+} Wal;
+
+/*
+ * lock serializes the page table, the CLOCK hand, frame bookkeeping, the log
+ * and the ring, so getPage can be called from any thread. Page contents are
+ * guarded by the frame latches instead. The mmap mode has no frames to latch
+ * and stays single-threaded.
+ * With io_uring, sequential misses start readahead windows and evicted dirty
+ * pages are written from copies in writeBuffers; writeSlotPages holds the
+ * page each slot is writing, or UINT32_MAX.
+ */
 typedef struct {
+    PagerMode mode;
+    pthread_mutex_t lock;
     int fileDescriptor;
-    uint32_t fileLength;
+    uint64_t fileLength;
     uint32_t numPages;
-    void* pages[TABLE_MAX_PAGES];
+    uint32_t numFrames;
+    Frame* frames;
+    void* frameMemory;
+    int32_t* pageTable;
+    uint32_t pageTableMask;
+    uint32_t clockHand;
+    void* mapping;
+    uint32_t mappedPages;
+    Wal* wal;
+    Frame** uncommittedFrames;
+    uint32_t numUncommitted;
+    bool inTransaction;
+    uint32_t transactionPages;
+    void* undoMemory;
+    Uring ring;
+    uint32_t readaheadPages;
+    uint32_t lastMissPageNum;
+    uint32_t readaheadMark;
+    uint32_t readaheadEnd;
+    void* writeBuffers;
+    uint32_t writeSlotPages[PAGER_WRITE_SLOTS];
+    uint32_t numWrites;
 } Pager;
 
+/*
+ * scanThreads is how many threads an aggregate scan of the table may use.
+ */
 typedef struct {
     uint32_t rootPageNum;
     Pager* pager;
+    uint32_t scanThreads;
 } Table;
 
+/*
+ * An inclusive range of keys that one scan worker handles at a time.
+ */
+typedef struct {
+    uint32_t low;
+    uint32_t high;
+} Morsel;
+
+/*
+ * path[0] is the root and path[depth - 1] the leaf the cursor is on;
+ * childIndex[i] is the position of path[i + 1] inside path[i]. leaf is the
+ * cursor's leaf while tableSeek or tableStart still holds it latched shared
+ * for the first cursorNextBatch, and NULL otherwise.
+ */
 typedef struct {
     Table *table;
     uint32_t pageNum;
     uint32_t cellNum;
     bool endOfTable;
+    uint32_t depth;
+    uint32_t path[BTREE_MAX_DEPTH];
+    uint32_t childIndex[BTREE_MAX_DEPTH];
+    void* leaf;
 } Cursor;
 
+/*
+ * Rows handed out a leaf at a time. The strings point into the leaf, which
+ * stays latched until the next batch is fetched or the batch is released, and
+ * are not NUL-terminated.
+ */
+typedef struct {
+    uint32_t numRows;
+    void* page;
+    uint32_t ids[ROW_BATCH_SIZE];
+    const char* usernames[ROW_BATCH_SIZE];
+    const char* emails[ROW_BATCH_SIZE];
+    uint8_t usernameLengths[ROW_BATCH_SIZE];
+    uint8_t emailLengths[ROW_BATCH_SIZE];
+} RowBatch;
+
+typedef enum {
+    OUTPUT_TEXT,
+    OUTPUT_CSV,
+    OUTPUT_BINARY
+} OutputFormat;
+
+/*
+ * Bytes waiting to be sent on a server connection, of which the first start
+ * already have been.
+ */
+typedef struct {
+    char* data;
+    size_t start;
+    size_t length;
+    size_t capacity;
+} OutputQueue;
+
+typedef enum {
+    RESPONSE_ROWS,
+    RESPONSE_OK,
+    RESPONSE_ERROR
+} ResponseType;
+
+/*
+ * Where result rows go. Rows are formatted straight into buffer and only
+ * handed to stdout when it fills up or the result set ends. Prompts and
+ * status messages go to messages, which is stderr in the machine-readable
+ * formats and in batch mode so that stdout carries nothing but rows.
+ * Batch mode also drops the prompt and the "Executed." lines. The server
+ * sets queue, and each flush then becomes a rows frame on it instead.
+ */
+typedef struct {
+    OutputFormat format;
+    bool batch;
+    bool timer;
+    FILE* messages;
+    char* buffer;
+    size_t length;
+    OutputQueue* queue;
+} ResultSink;
+
+/*
+ * Engine-wide counters, reset by .stats reset. Latencies are kept per
+ * statement type in power-of-two microsecond buckets: bucket 0 is under 1us,
+ * bucket i covers [2^(i-1), 2^i) us and the last one everything slower.
+ */
+typedef struct {
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t evictions;
+    uint64_t pagesRead;
+    uint64_t pagesPrefetched;
+    uint64_t pagesWritten;
+    uint64_t walFramesWritten;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t readCalls;
+    uint64_t writeCalls;
+    uint64_t syncCalls;
+    uint64_t leafSplits;
+    uint64_t internalSplits;
+    uint64_t rootSplits;
+    uint64_t nodeMerges;
+    uint64_t nodeRedistributions;
+    uint64_t rootCollapses;
+    uint64_t pagesFreed;
+    uint64_t pagesReused;
+    uint64_t updatesInPlace;
+    uint64_t updatesRelocated;
+    uint64_t rowsScanned;
+    uint64_t rowsReturned;
+    uint64_t statements[NUM_STATEMENT_TYPES];
+    uint64_t statementNanoseconds[NUM_STATEMENT_TYPES];
+    uint64_t latency[NUM_STATEMENT_TYPES][STATS_LATENCY_BUCKETS];
+} EngineStats;
+
 typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
 
-const uint32_t ID_SIZE = sizeOfAttribute(Row, id);
-const uint32_t USERNAME_SIZE = sizeOfAttribute(Row, username);
-const uint32_t EMAIL_SIZE = sizeOfAttribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 const uint32_t PAGE_SIZE = 4096;
-const uint32_t ROWS_PER_PAGE = (PAGE_SIZE / ROW_SIZE);
-const uint32_t TABLE_MAX_ROWS = (ROWS_PER_PAGE * TABLE_MAX_PAGES);
 
 /*
  * Common Node Header Layout
@@ -97,15 +421,82 @@ const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_P
  */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_CONTENT_START_SIZE
+                                       + LEAF_NODE_NEXT_LEAF_SIZE;
 
 /*
- * Leaf Node Body Layout
+ * Leaf Node Body Layout: the keys of all cells sit in one array right after
+ * the header, followed by an array of their cell offsets. Both grow up while
+ * cells are packed down from the end of the page. A cell holds two
+ * length-prefixed fields: the username and email in the table, the column
+ * value and the row's id in an index.
  */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
+const uint32_t LEAF_NODE_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_OFFSET_SIZE;
+const uint32_t LEAF_NODE_STRING_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t LEAF_NODE_MAX_CELL_SIZE = 2 * LEAF_NODE_STRING_LENGTH_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
 const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+const uint32_t LEAF_NODE_MIN_CELLS = LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_MAX_CELL_SIZE + LEAF_NODE_SLOT_SIZE);
+// A leaf using fewer bytes than this after a delete merges with or borrows from a sibling
+const uint32_t LEAF_NODE_MIN_FILL = LEAF_NODE_SPACE_FOR_CELLS / 4;
+
+/*
+ * Index Catalog: nodes never use their parent pointer, so on page 0 it holds
+ * the page number of the catalog page, or 0 while there is none. The catalog
+ * page lists the root page of each column's index, 0 for none, followed by
+ * the first page of the free list. A free page holds the next one, and 0
+ * ends the list.
+ */
+const uint32_t ROOT_CATALOG_PAGE_OFFSET = PARENT_POINTER_OFFSET;
+const uint32_t CATALOG_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_FREE_HEAD_OFFSET = NUM_INDEXABLE_COLUMNS * CATALOG_ROOT_SIZE;
+const uint32_t FREE_PAGE_NEXT_OFFSET = 0;
+
+/*
+ * Internal Node Header Layout: the right child has no cell, so its subtree's
+ * row count lives in the header. Padding after the common header keeps every
+ * field and cell 4-byte aligned, which the atomically updated counts need.
+ */
+const uint32_t INTERNAL_NODE_PADDING_SIZE = sizeof(uint16_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_PADDING_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_OFFSET = INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = INTERNAL_NODE_RIGHT_COUNT_OFFSET + INTERNAL_NODE_RIGHT_COUNT_SIZE;
+
+/*
+ * Internal Node Body Layout: each cell holds a child page, a key no smaller
+ * than any in that child and the number of rows below it. The key starts out
+ * as the child's largest; deletes can leave it above that.
+ */
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_COUNT_SIZE;
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+// A non-root internal node left with fewer children than this merges with or borrows from a sibling
+const uint32_t INTERNAL_NODE_MIN_CHILDREN = (INTERNAL_NODE_MAX_CELLS + 1) / 4;
+
+/*
+ * WAL Layout: a file header, then one frame header plus page image per logged page.
+ * A frame whose commit field is nonzero ends a commit and records the page count.
+ */
+const uint32_t WAL_HEADER_MAGIC_OFFSET = 0;
+const uint32_t WAL_HEADER_VERSION_OFFSET = 4;
+const uint32_t WAL_HEADER_PAGE_SIZE_OFFSET = 8;
+const uint32_t WAL_HEADER_SALT_OFFSET = 12;
+const uint32_t WAL_HEADER_SIZE = 16;
+const uint32_t WAL_FRAME_PAGE_NUM_OFFSET = 0;
+const uint32_t WAL_FRAME_COMMIT_OFFSET = 4;
+const uint32_t WAL_FRAME_SALT_OFFSET = 8;
+const uint32_t WAL_FRAME_CHECKSUM_OFFSET = 12;
+const uint32_t WAL_FRAME_HEADER_SIZE = 16;
+const uint32_t WAL_FRAME_SIZE = WAL_FRAME_HEADER_SIZE + PAGE_SIZE;
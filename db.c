@@ -1,44 +1,25 @@
-#include "fileOperations.c"
+#include "index.c"
 
-uint32_t* leafNodeNCells(void* node) {
-    return (uint32_t*) (node + LEAF_NODE_NUM_CELLS_OFFSET);
-}
-
-void initializeLeafNode(void* node) { *leafNodeNCells(node) = 0; }
-
-void pagerFlush(Pager* pager, uint32_t pageNum) {
-    if (pager -> pages[pageNum] == NULL) {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
-    }
-    off_t offset = lseek(pager -> fileDescriptor, pageNum * PAGE_SIZE, SEEK_SET);
-
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
-    }
-
-    ssize_t bytesWritten = write(pager -> fileDescriptor, pager->pages[pageNum], PAGE_SIZE);
-
-    if (bytesWritten == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
-    }
-}
-
-Table* openDB(const char* filename) {
-    Pager* pager = pagerOpen(filename);
-    uint32_t num_rows = pager -> fileLength / ROW_SIZE;
+Table* openDB(const char* filename, PagerOptions options) {
+    Pager* pager = pagerOpen(filename, options);
 
     Table* table = (Table*) malloc(sizeof(Table));
     table -> pager = pager;
 
     table-> rootPageNum = 0;
 
+    // Parallel scans use every online CPU unless told otherwise
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    table -> scanThreads = cpus > 0 ? (uint32_t) cpus : 1;
+
     if (pager -> numPages == 0) {
         // New database file. Initialize page 0 as leaf node.
         void* rootNode = getPage(pager, 0);
+        markPageDirty(pager, 0);
         initializeLeafNode(rootNode);
+        setNodeRoot(rootNode, true);
+        unpinPage(pager, 0);
+        pagerCommit(pager);
     }
 
     return table;
@@ -47,11 +28,23 @@ Table* openDB(const char* filename) {
 void closeDB(Table* table) {
     Pager* pager = table -> pager;
 
-    for (uint32_t i = 0; i < pager -> numPages; i++) {
-        if (pager->pages[i] != NULL) {
-            pagerFlush(pager, i);
-            free(pager -> pages[i]);
-            pager -> pages[i] = NULL;
+    // A transaction still open at exit never happened
+    if (pager -> inTransaction) {
+        pagerRollback(pager);
+    }
+    pagerCommit(pager);
+    pagerCheckpoint(pager);
+    // Readahead may still be filling frames that are about to be freed
+    while (pagerWaitIo(pager)) {
+    }
+    uringClose(&(pager -> ring));
+
+    if (pager -> mode == PAGER_MMAP) {
+        munmap(pager -> mapping, MMAP_RESERVE_SIZE);
+        // Drop the slack left by geometric growth
+        if (ftruncate(pager -> fileDescriptor, (off_t) pager -> numPages * PAGE_SIZE) == -1) {
+            printf("Error truncating db file.\n");
+            exit(EXIT_FAILURE);
         }
     }
 
@@ -61,13 +54,19 @@ void closeDB(Table* table) {
         exit(EXIT_FAILURE);
     }
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager -> pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
-        }
+    for (uint32_t i = 0; i < pager -> numFrames; i++) {
+        pthread_rwlock_destroy(&(pager -> frames[i].latch));
+    }
+    pthread_mutex_destroy(&(pager -> lock));
+    free(pager -> frameMemory);
+    free(pager -> frames);
+    free(pager -> pageTable);
+    free(pager -> uncommittedFrames);
+    free(pager -> undoMemory);
+    free(pager -> writeBuffers);
+    if (pager -> wal != NULL) {
+        walClose(pager -> wal);
     }
     free(pager);
     free(table);
-}
\ No newline at end of file
+}
@@ -2,9 +2,87 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
-#include "insert.c"
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
-Pager* pagerOpen(const char* filename) {
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#include "uring.c"
+
+/*
+ * Buckets of the page number -> frame hash table. Collisions chain through Frame.hashNext.
+ */
+uint32_t pageTableBucket(Pager* pager, uint32_t pageNum) {
+    return (pageNum * 2654435761u) & pager -> pageTableMask;
+}
+
+int32_t pageTableLookup(Pager* pager, uint32_t pageNum) {
+    int32_t frameIndex = pager -> pageTable[pageTableBucket(pager, pageNum)];
+    while (frameIndex != -1 && pager -> frames[frameIndex].pageNum != pageNum) {
+        frameIndex = pager -> frames[frameIndex].hashNext;
+    }
+    return frameIndex;
+}
+
+void pageTableInsert(Pager* pager, int32_t frameIndex) {
+    uint32_t bucket = pageTableBucket(pager, pager -> frames[frameIndex].pageNum);
+    pager -> frames[frameIndex].hashNext = pager -> pageTable[bucket];
+    pager -> pageTable[bucket] = frameIndex;
+}
+
+void pageTableRemove(Pager* pager, int32_t frameIndex) {
+    int32_t* link = &(pager -> pageTable[pageTableBucket(pager, pager -> frames[frameIndex].pageNum)]);
+    while (*link != frameIndex) {
+        link = &(pager -> frames[*link].hashNext);
+    }
+    *link = pager -> frames[frameIndex].hashNext;
+}
+
+/*
+ * Map numPages pages of the file, growing it first if needed. The whole
+ * reservation is claimed at open, so extending the mapping in place with
+ * MAP_FIXED never moves pages that callers already hold pointers to.
+ */
+void mmapExtend(Pager* pager, uint32_t numPages) {
+    if ((uint64_t) numPages * PAGE_SIZE > MMAP_RESERVE_SIZE) {
+        printf("Database exceeds the %llu byte mmap reservation.\n", (unsigned long long) MMAP_RESERVE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    off_t newLength = (off_t) numPages * PAGE_SIZE;
+    if ((uint64_t) newLength > pager -> fileLength) {
+        if (ftruncate(pager -> fileDescriptor, newLength) == -1) {
+            printf("Error growing file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager -> fileLength = newLength;
+    }
+
+    off_t mappedLength = (off_t) pager -> mappedPages * PAGE_SIZE;
+    void* extension = mmap(pager -> mapping + mappedLength, newLength - mappedLength, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_FIXED, pager -> fileDescriptor, mappedLength);
+    if (extension == MAP_FAILED) {
+        printf("Error mapping file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager -> mappedPages = numPages;
+}
+
+void mmapOpen(Pager* pager) {
+    pager -> mapping = mmap(NULL, MMAP_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pager -> mapping == MAP_FAILED) {
+        printf("Error reserving address space: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager -> mappedPages = 0;
+    if (pager -> numPages > 0) {
+        mmapExtend(pager, pager -> numPages);
+    }
+}
+
+Pager* pagerOpen(const char* filename, PagerOptions options) {
     int fd = open(filename,  O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
     if (fd == -1) {
         printf("Unable to open file\n");
@@ -13,6 +91,8 @@ Pager* pagerOpen(const char* filename) {
 
     off_t fileLength = lseek(fd, 0, SEEK_END);
     Pager* pager = (Pager*) malloc(sizeof(Pager));
+    pager -> mode = options.mode;
+    pthread_mutex_init(&(pager -> lock), NULL);
     pager -> fileDescriptor = fd;
     pager -> fileLength = fileLength;
     pager-> numPages = (fileLength / PAGE_SIZE);
@@ -22,41 +102,690 @@ Pager* pagerOpen(const char* filename) {
         exit(EXIT_FAILURE);
     }
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+    // Bring the file up to date with whatever a previous session committed to the log
+    Wal* wal = walOpen(filename, options.groupCommitSize);
+    pager -> numPages = walRecover(wal, fd, pager -> numPages);
+    pager -> fileLength = lseek(fd, 0, SEEK_END);
+    walReset(wal);
+
+    pager -> mapping = NULL;
+    pager -> mappedPages = 0;
+    pager -> uncommittedFrames = NULL;
+    pager -> numUncommitted = 0;
+    pager -> inTransaction = false;
+    pager -> transactionPages = 0;
+    pager -> undoMemory = NULL;
+    memset(&(pager -> ring), 0, sizeof(Uring));
+    pager -> ring.fileDescriptor = -1;
+    pager -> readaheadPages = 0;
+    pager -> lastMissPageNum = UINT32_MAX;
+    pager -> readaheadMark = UINT32_MAX;
+    pager -> readaheadEnd = 0;
+    pager -> writeBuffers = NULL;
+    pager -> numWrites = 0;
+    for (uint32_t i = 0; i < PAGER_WRITE_SLOTS; i++) {
+        pager -> writeSlotPages[i] = UINT32_MAX;
+    }
+    if (pager -> mode == PAGER_MMAP) {
+        // Stores land in the file directly, so there is nothing to log
+        walClose(wal);
+        pager -> wal = NULL;
+        pager -> numFrames = 0;
+        pager -> frames = NULL;
+        pager -> frameMemory = NULL;
+        pager -> pageTable = NULL;
+        mmapOpen(pager);
+        return pager;
+    }
+    pager -> wal = wal;
+
+    uint32_t numFrames = options.numFrames;
+    if (numFrames < MIN_POOL_FRAMES) {
+        numFrames = MIN_POOL_FRAMES;
+    }
+
+    // Every frame is allocated up front so the pool never grows past numFrames pages.
+    pager -> numFrames = numFrames;
+    pager -> frames = (Frame*) malloc(numFrames * sizeof(Frame));
+    pager -> frameMemory = malloc((size_t) numFrames * PAGE_SIZE);
+    pager -> clockHand = 0;
+    for (uint32_t i = 0; i < numFrames; i++) {
+        pager -> frames[i].valid = false;
+        pager -> frames[i].pinCount = 0;
+        pager -> frames[i].referenced = false;
+        pager -> frames[i].dirty = false;
+        pager -> frames[i].uncommitted = false;
+        pager -> frames[i].loading = false;
+        pager -> frames[i].hashNext = -1;
+        pthread_rwlock_init(&(pager -> frames[i].latch), NULL);
+        pager -> frames[i].data = pager -> frameMemory + (size_t) i * PAGE_SIZE;
+    }
+
+    uint32_t pageTableSize = 1;
+    while (pageTableSize < numFrames * 2) {
+        pageTableSize <<= 1;
+    }
+    pager -> pageTableMask = pageTableSize - 1;
+    pager -> pageTable = (int32_t*) malloc(pageTableSize * sizeof(int32_t));
+    pager -> uncommittedFrames = (Frame**) malloc(numFrames * sizeof(Frame*));
+    for (uint32_t i = 0; i < pageTableSize; i++) {
+        pager -> pageTable[i] = -1;
+    }
+
+    // Readahead gets at most a quarter of the pool, so it can't flush out the working set
+    if (!options.syncIo && uringOpen(&(pager -> ring), URING_ENTRIES)) {
+        pager -> readaheadPages = options.readaheadPages < numFrames / 4 ? options.readaheadPages : numFrames / 4;
+        pager -> writeBuffers = malloc((size_t) PAGER_WRITE_SLOTS * PAGE_SIZE);
     }
 
     return pager;
 }
 
-void* getPage(Pager* pager, uint32_t pageNum) {
-    if (pageNum > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", pageNum, TABLE_MAX_PAGES);
+void pagerWriteFrame(Pager* pager, Frame* frame) {
+    ssize_t bytesWritten = pwrite(pager -> fileDescriptor, frame -> data, PAGE_SIZE, (off_t) frame -> pageNum * PAGE_SIZE);
+
+    if (bytesWritten == -1) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    engineStats.writeCalls++;
+    engineStats.bytesWritten += bytesWritten;
+    engineStats.pagesWritten++;
+    if ((uint64_t) (frame -> pageNum + 1) * PAGE_SIZE > pager -> fileLength) {
+        pager -> fileLength = (uint64_t) (frame -> pageNum + 1) * PAGE_SIZE;
+    }
+    frame -> dirty = false;
+}
+
+/*
+ * Mutation paths call this on a pinned page before changing it, so only
+ * modified pages are ever written back. Pages readers can reach must be
+ * latched exclusively first, apart from the atomically bumped row counts.
+ * Inside a transaction the first call also saves the page's before-image
+ * for rollback.
+ */
+void markPageDirty(Pager* pager, uint32_t pageNum) {
+    if (pager -> mode == PAGER_MMAP) {
+        // Stores into the shared mapping are tracked by the kernel
+        return;
+    }
+    pthread_mutex_lock(&(pager -> lock));
+    int32_t frameIndex = pageTableLookup(pager, pageNum);
+    if (frameIndex == -1) {
+        printf("Tried to dirty page %d which is not cached\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+    Frame* frame = &(pager -> frames[frameIndex]);
+    frame -> dirty = true;
+    if (!frame -> uncommitted) {
+        if (pager -> inTransaction && pageNum < pager -> transactionPages) {
+            memcpy(pager -> undoMemory + (size_t) frameIndex * PAGE_SIZE, frame -> data, PAGE_SIZE);
+        }
+        frame -> uncommitted = true;
+        pager -> uncommittedFrames[pager -> numUncommitted++] = frame;
+    }
+    pthread_mutex_unlock(&(pager -> lock));
+}
+
+int compareFramesByPageNum(const void* a, const void* b) {
+    uint32_t left = (*(Frame**) a) -> pageNum;
+    uint32_t right = (*(Frame**) b) -> pageNum;
+    return (left > right) - (left < right);
+}
+
+/*
+ * Write one run of frames holding consecutive pages with a single pwritev.
+ */
+void pagerWriteRun(Pager* pager, Frame** run, uint32_t runLength) {
+    struct iovec iov[runLength];
+    for (uint32_t i = 0; i < runLength; i++) {
+        iov[i].iov_base = run[i] -> data;
+        iov[i].iov_len = PAGE_SIZE;
+    }
+
+    off_t offset = (off_t) run[0] -> pageNum * PAGE_SIZE;
+    size_t remaining = (size_t) runLength * PAGE_SIZE;
+    struct iovec* next = iov;
+    int count = (int) runLength;
+    while (remaining > 0) {
+        ssize_t bytesWritten = pwritev(pager -> fileDescriptor, next, count, offset);
+        if (bytesWritten == -1) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        engineStats.writeCalls++;
+        engineStats.bytesWritten += bytesWritten;
+        // Short write: skip the pages that made it and resume mid-iovec
+        offset += bytesWritten;
+        remaining -= bytesWritten;
+        while (count > 0 && (size_t) bytesWritten >= next -> iov_len) {
+            bytesWritten -= next -> iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next -> iov_base += bytesWritten;
+            next -> iov_len -= bytesWritten;
+        }
+    }
+
+    engineStats.pagesWritten += runLength;
+    uint64_t runEnd = (uint64_t) (run[runLength - 1] -> pageNum + 1) * PAGE_SIZE;
+    if (runEnd > pager -> fileLength) {
+        pager -> fileLength = runEnd;
+    }
+    for (uint32_t i = 0; i < runLength; i++) {
+        run[i] -> dirty = false;
+    }
+}
+
+/*
+ * Write back every dirty frame in page order, merging adjacent pages into one
+ * vectored write. Clean frames cost nothing.
+ */
+void pagerFlushAll(Pager* pager) {
+    if (pager -> mode == PAGER_MMAP) {
+        if (pager -> mappedPages > 0 && msync(pager -> mapping, (size_t) pager -> mappedPages * PAGE_SIZE, MS_SYNC) == -1) {
+            printf("Error syncing mapping: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        engineStats.syncCalls++;
+        return;
+    }
+
+    Frame** dirtyFrames = (Frame**) malloc(pager -> numFrames * sizeof(Frame*));
+    uint32_t numDirty = 0;
+    for (uint32_t i = 0; i < pager -> numFrames; i++) {
+        if (pager -> frames[i].valid && pager -> frames[i].dirty) {
+            dirtyFrames[numDirty++] = &(pager -> frames[i]);
+        }
+    }
+    qsort(dirtyFrames, numDirty, sizeof(Frame*), compareFramesByPageNum);
+
+    uint32_t runStart = 0;
+    for (uint32_t i = 1; i <= numDirty; i++) {
+        bool runEnds = i == numDirty
+                       || dirtyFrames[i] -> pageNum != dirtyFrames[i - 1] -> pageNum + 1
+                       || i - runStart == IOV_MAX;
+        if (runEnds) {
+            pagerWriteRun(pager, dirtyFrames + runStart, i - runStart);
+            runStart = i;
+        }
+    }
+    free(dirtyFrames);
+}
+
+void pagerFlush(Pager* pager, uint32_t pageNum) {
+    if (pager -> mode == PAGER_MMAP) {
+        if (msync(pager -> mapping + (size_t) pageNum * PAGE_SIZE, PAGE_SIZE, MS_SYNC) == -1) {
+            printf("Error syncing page: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        engineStats.syncCalls++;
+        return;
+    }
+    pthread_mutex_lock(&(pager -> lock));
+    int32_t frameIndex = pageTableLookup(pager, pageNum);
+    if (frameIndex == -1) {
+        printf("Tried to flush null page\n");
         exit(EXIT_FAILURE);
     }
+    pagerWriteFrame(pager, &(pager -> frames[frameIndex]));
+    pthread_mutex_unlock(&(pager -> lock));
+}
+
+/*
+ * Finish one ring request. Reads carry their frame index as user data and
+ * writes their slot tagged with PAGER_IO_WRITE.
+ */
+void pagerCompleteIo(Pager* pager, uint64_t userData, int32_t result) {
+    if (userData & PAGER_IO_WRITE) {
+        uint32_t slot = (uint32_t) (userData & ~PAGER_IO_WRITE);
+        if (result != (int32_t) PAGE_SIZE) {
+            printf("Error writing: %d\n", result < 0 ? -result : EIO);
+            exit(EXIT_FAILURE);
+        }
+        engineStats.bytesWritten += result;
+        uint64_t pageEnd = (uint64_t) (pager -> writeSlotPages[slot] + 1) * PAGE_SIZE;
+        if (pageEnd > pager -> fileLength) {
+            pager -> fileLength = pageEnd;
+        }
+        pager -> writeSlotPages[slot] = UINT32_MAX;
+        pager -> numWrites--;
+        return;
+    }
+
+    Frame* frame = &(pager -> frames[userData]);
+    if (result < 0) {
+        printf("Error reading file: %d\n", -result);
+        exit(EXIT_FAILURE);
+    }
+    engineStats.bytesRead += result;
+    if (result < (int32_t) PAGE_SIZE) {
+        memset(frame -> data + result, 0, PAGE_SIZE - result);
+    }
+    frame -> loading = false;
+}
+
+/*
+ * Block for one ring completion. Returns false if nothing was in flight.
+ */
+bool pagerWaitIo(Pager* pager) {
+    uint64_t userData;
+    int32_t result;
+    if (pager -> ring.fileDescriptor == -1 || !uringReap(&(pager -> ring), true, &userData, &result)) {
+        return false;
+    }
+    pagerCompleteIo(pager, userData, result);
+    return true;
+}
+
+void pagerWaitWrites(Pager* pager) {
+    while (pager -> numWrites > 0) {
+        pagerWaitIo(pager);
+    }
+}
+
+bool pagerWriting(Pager* pager, uint32_t pageNum) {
+    if (pager -> numWrites == 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < PAGER_WRITE_SLOTS; i++) {
+        if (pager -> writeSlotPages[i] == pageNum) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Write an evicted page back without waiting for it. The page is copied to a
+ * write slot so its frame can be reused at once; reading it again waits for
+ * the write first.
+ */
+void pagerWriteBack(Pager* pager, Frame* frame) {
+    if (pager -> ring.fileDescriptor == -1) {
+        pagerWriteFrame(pager, frame);
+        return;
+    }
+    while (pager -> numWrites == PAGER_WRITE_SLOTS) {
+        pagerWaitIo(pager);
+    }
+    uint32_t slot = 0;
+    while (pager -> writeSlotPages[slot] != UINT32_MAX) {
+        slot++;
+    }
+    void* buffer = pager -> writeBuffers + (size_t) slot * PAGE_SIZE;
+    memcpy(buffer, frame -> data, PAGE_SIZE);
+    while (!uringQueueWrite(&(pager -> ring), pager -> fileDescriptor, buffer, PAGE_SIZE,
+                            (uint64_t) frame -> pageNum * PAGE_SIZE, PAGER_IO_WRITE | slot)) {
+        pagerWaitIo(pager);
+    }
+    uringSubmit(&(pager -> ring));
+    pager -> writeSlotPages[slot] = frame -> pageNum;
+    pager -> numWrites++;
+    engineStats.writeCalls++;
+    engineStats.pagesWritten++;
+    frame -> dirty = false;
+}
+
+/*
+ * CLOCK sweep: skip pinned frames and frames still being read, give recently
+ * referenced ones a second chance, and write the victim back before handing
+ * its frame out. Frames holding uncommitted changes are never stolen, and a
+ * committed page only reaches the file after its log records are durable.
+ * Returns -1 if no frame can be taken right now.
+ */
+int32_t pagerTryEvict(Pager* pager) {
+    for (uint32_t scanned = 0; scanned < 2 * pager -> numFrames; scanned++) {
+        int32_t frameIndex = pager -> clockHand;
+        Frame* frame = &(pager -> frames[frameIndex]);
+        pager -> clockHand = (pager -> clockHand + 1) % pager -> numFrames;
+
+        if (!frame -> valid) {
+            return frameIndex;
+        }
+        if (__atomic_load_n(&(frame -> pinCount), __ATOMIC_ACQUIRE) > 0 || frame -> uncommitted || frame -> loading) {
+            continue;
+        }
+        if (frame -> referenced) {
+            frame -> referenced = false;
+            continue;
+        }
+
+        if (frame -> dirty) {
+            if (pager -> wal != NULL) {
+                walSync(pager -> wal);
+            }
+            pagerWriteBack(pager, frame);
+        }
+        engineStats.evictions++;
+        pageTableRemove(pager, frameIndex);
+        frame -> valid = false;
+        return frameIndex;
+    }
+    return -1;
+}
+
+int32_t pagerEvict(Pager* pager) {
+    for (;;) {
+        int32_t frameIndex = pagerTryEvict(pager);
+        if (frameIndex != -1) {
+            return frameIndex;
+        }
+        // Frames still being read in come free once their reads land
+        if (!pagerWaitIo(pager)) {
+            printf("Buffer pool exhausted: all %d frames are pinned or uncommitted.\n", pager -> numFrames);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Claim a frame for pageNum and queue a ring read into it. The frame stays
+ * loading, and unevictable, until the read completes.
+ */
+void pagerQueueRead(Pager* pager, int32_t frameIndex, uint32_t pageNum) {
+    Frame* frame = &(pager -> frames[frameIndex]);
+    frame -> pageNum = pageNum;
+    frame -> valid = true;
+    frame -> dirty = false;
+    frame -> loading = true;
+    __atomic_store_n(&(frame -> pinCount), 0, __ATOMIC_RELAXED);
+    pageTableInsert(pager, frameIndex);
+    while (!uringQueueRead(&(pager -> ring), pager -> fileDescriptor, frame -> data, PAGE_SIZE,
+                           (uint64_t) pageNum * PAGE_SIZE, (uint64_t) frameIndex)) {
+        pagerWaitIo(pager);
+    }
+}
+
+/*
+ * Hand the queued reads to the kernel as one batch.
+ */
+void pagerSubmitReads(Pager* pager) {
+    if (pager -> ring.unsubmitted > 0) {
+        uringSubmit(&(pager -> ring));
+        engineStats.readCalls++;
+    }
+}
+
+/*
+ * Queue reads for the pages from start on that aren't cached yet, up to the
+ * readahead window or the end of the file. Reaching the middle of the window
+ * starts the next one.
+ */
+void pagerReadahead(Pager* pager, uint32_t start) {
+    uint32_t filePages = (uint32_t) (pager -> fileLength / PAGE_SIZE);
+    uint32_t end = start + pager -> readaheadPages;
+    if (end > filePages) {
+        end = filePages;
+    }
+    pager -> readaheadMark = UINT32_MAX;
+    if (start >= end) {
+        return;
+    }
+
+    uint32_t queued = 0;
+    for (uint32_t pageNum = start; pageNum < end; pageNum++) {
+        if (pageTableLookup(pager, pageNum) != -1 || pagerWriting(pager, pageNum)) {
+            continue;
+        }
+        int32_t frameIndex = pagerTryEvict(pager);
+        if (frameIndex == -1) {
+            break;
+        }
+        pagerQueueRead(pager, frameIndex, pageNum);
+        // Counts as a use, so the pages survive until the scan gets to them
+        pager -> frames[frameIndex].referenced = true;
+        queued++;
+    }
+    engineStats.pagesPrefetched += queued;
+    pager -> readaheadMark = start + (end - start) / 2;
+    pager -> readaheadEnd = end;
+}
+
+/*
+ * Fetch a page into the pool and pin it. The caller must unpinPage() it once
+ * done; the returned pointer is only guaranteed stable while the pin is held.
+ * A miss on the page right after the previous miss is read through the ring
+ * together with a readahead window behind it; other misses use pread.
+ */
+void* getPage(Pager* pager, uint32_t pageNum) {
+    if (pager -> mode == PAGER_MMAP) {
+        if (pageNum >= pager -> mappedPages) {
+            // Grow geometrically so appends don't remap on every new page
+            uint32_t numPages = pager -> mappedPages * 2;
+            if (numPages < pageNum + 1) {
+                numPages = pageNum + 1;
+            }
+            if (numPages < MMAP_MIN_GROWTH_PAGES) {
+                numPages = MMAP_MIN_GROWTH_PAGES;
+            }
+            mmapExtend(pager, numPages);
+        }
+        if (pageNum >= pager -> numPages) {
+            pager -> numPages = pageNum + 1;
+        }
+        return pager -> mapping + (size_t) pageNum * PAGE_SIZE;
+    }
 
-    if (pager -> pages[pageNum] == NULL) {
-        // Cache miss. Allocate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
-        uint32_t numPages = pager->fileLength / PAGE_SIZE;
+    pthread_mutex_lock(&(pager -> lock));
+    int32_t frameIndex = pageTableLookup(pager, pageNum);
 
-        // We might save a partial page at the end of the file
-        if (pager->fileLength % PAGE_SIZE) {
-            numPages += 1;
+    if (frameIndex == -1) {
+        // Cache miss. Claim a frame and load from file.
+        engineStats.cacheMisses++;
+        engineStats.pagesRead++;
+        // The file copy is stale until an earlier write-back of this page lands
+        while (pagerWriting(pager, pageNum)) {
+            pagerWaitIo(pager);
         }
+        frameIndex = pagerEvict(pager);
+        Frame* frame = &(pager -> frames[frameIndex]);
 
-        if (pageNum <= numPages) {
-            lseek(pager -> fileDescriptor, pageNum * PAGE_SIZE, SEEK_SET);
-            ssize_t bytesRead = read(pager -> fileDescriptor, page, PAGE_SIZE);
+        bool sequential = pageNum == pager -> lastMissPageNum + 1;
+        pager -> lastMissPageNum = pageNum;
+        if (sequential && pager -> readaheadPages > 0 && (uint64_t) pageNum * PAGE_SIZE < pager -> fileLength) {
+            pagerQueueRead(pager, frameIndex, pageNum);
+            pagerReadahead(pager, pageNum + 1);
+            pagerSubmitReads(pager);
+        } else {
+            ssize_t bytesRead = pread(pager -> fileDescriptor, frame -> data, PAGE_SIZE, (off_t) pageNum * PAGE_SIZE);
             if (bytesRead == -1) {
                 printf("Error reading file: %d\n", errno);
                 exit(EXIT_FAILURE);
             }
+            engineStats.readCalls++;
+            engineStats.bytesRead += bytesRead;
+            // Pages past the end of the file have never been written yet
+            if (bytesRead < PAGE_SIZE) {
+                memset(frame -> data + bytesRead, 0, PAGE_SIZE - bytesRead);
+            }
+
+            frame -> pageNum = pageNum;
+            frame -> valid = true;
+            frame -> dirty = false;
+            __atomic_store_n(&(frame -> pinCount), 0, __ATOMIC_RELAXED);
+            pageTableInsert(pager, frameIndex);
         }
-        pager -> pages[pageNum] = page;
+
         if (pageNum >= pager -> numPages) {
             pager -> numPages = pageNum + 1;
         }
+    } else {
+        engineStats.cacheHits++;
+    }
+
+    Frame* frame = &(pager -> frames[frameIndex]);
+    __atomic_fetch_add(&(frame -> pinCount), 1, __ATOMIC_ACQUIRE);
+    frame -> referenced = true;
+    // Only once pinned, since readahead may evict
+    if (pageNum == pager -> readaheadMark) {
+        pagerReadahead(pager, pager -> readaheadEnd);
+        pagerSubmitReads(pager);
+    }
+    while (frame -> loading) {
+        pagerWaitIo(pager);
+    }
+    pthread_mutex_unlock(&(pager -> lock));
+    return frame -> data;
+}
+
+void unpinPage(Pager* pager, uint32_t pageNum) {
+    if (pager -> mode == PAGER_MMAP) {
+        return;
+    }
+    pthread_mutex_lock(&(pager -> lock));
+    int32_t frameIndex = pageTableLookup(pager, pageNum);
+    if (frameIndex == -1 || __atomic_load_n(&(pager -> frames[frameIndex].pinCount), __ATOMIC_RELAXED) == 0) {
+        printf("Tried to unpin page %d which is not pinned\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+    __atomic_fetch_sub(&(pager -> frames[frameIndex].pinCount), 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(pager -> lock));
+}
+
+/*
+ * getPage, then latch the page shared or exclusive. The latch is taken after
+ * the pager lock is dropped, so waiting for it never stalls other threads'
+ * page fetches.
+ */
+void* getPageLatched(Pager* pager, uint32_t pageNum, bool exclusive) {
+    void* page = getPage(pager, pageNum);
+    if (pager -> mode == PAGER_MMAP) {
+        return page;
+    }
+    Frame* frame = &(pager -> frames[(page - pager -> frameMemory) / PAGE_SIZE]);
+    if (exclusive) {
+        pthread_rwlock_wrlock(&(frame -> latch));
+    } else {
+        pthread_rwlock_rdlock(&(frame -> latch));
+    }
+    return page;
+}
+
+/*
+ * Release a page from getPageLatched. The frame is found from the page's
+ * address, so this needs neither the page table nor the pager lock.
+ */
+void unlatchPage(Pager* pager, void* page) {
+    if (pager -> mode == PAGER_MMAP) {
+        return;
+    }
+    Frame* frame = &(pager -> frames[(page - pager -> frameMemory) / PAGE_SIZE]);
+    pthread_rwlock_unlock(&(frame -> latch));
+    __atomic_fetch_sub(&(frame -> pinCount), 1, __ATOMIC_RELEASE);
+}
+
+void pagerSync(Pager* pager) {
+    if (pager -> wal != NULL) {
+        pthread_mutex_lock(&(pager -> lock));
+        walSync(pager -> wal);
+        pthread_mutex_unlock(&(pager -> lock));
+    }
+}
+
+/*
+ * Copy every committed page into the database file and start a fresh log.
+ */
+void pagerCheckpoint(Pager* pager) {
+    if (pager -> wal == NULL) {
+        pagerFlushAll(pager);
+        return;
     }
-    return pager -> pages[pageNum];
-}
\ No newline at end of file
+    pthread_mutex_lock(&(pager -> lock));
+    walSync(pager -> wal);
+    pagerFlushAll(pager);
+    pagerWaitWrites(pager);
+    if (fsync(pager -> fileDescriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    engineStats.syncCalls++;
+    walReset(pager -> wal);
+    pthread_mutex_unlock(&(pager -> lock));
+}
+
+/*
+ * Log the pages changed since the last commit. They become evictable again
+ * right away; durability follows at the next group sync.
+ */
+void pagerCommit(Pager* pager) {
+    if (pager -> wal == NULL || pager -> numUncommitted == 0) {
+        return;
+    }
+    pthread_mutex_lock(&(pager -> lock));
+    walAppendCommit(pager -> wal, pager -> uncommittedFrames, pager -> numUncommitted, pager -> numPages);
+    for (uint32_t i = 0; i < pager -> numUncommitted; i++) {
+        pager -> uncommittedFrames[i] -> uncommitted = false;
+    }
+    pager -> numUncommitted = 0;
+    pthread_mutex_unlock(&(pager -> lock));
+
+    if (pager -> wal -> framesSinceCheckpoint >= WAL_CHECKPOINT_FRAMES) {
+        pagerCheckpoint(pager);
+    }
+}
+
+/*
+ * True if another numPages pages can be dirtied without running the pool out
+ * of frames. Uncommitted frames can't be evicted, so a transaction is bounded
+ * by the pool size.
+ */
+bool pagerHasRoom(Pager* pager, uint32_t numPages) {
+    if (pager -> mode == PAGER_MMAP) {
+        return true;
+    }
+    return pager -> numUncommitted + numPages <= pager -> numFrames;
+}
+
+void pagerBegin(Pager* pager) {
+    if (pager -> undoMemory == NULL) {
+        pager -> undoMemory = malloc((size_t) pager -> numFrames * PAGE_SIZE);
+    }
+    pager -> inTransaction = true;
+    pager -> transactionPages = pager -> numPages;
+}
+
+/*
+ * Log every page the transaction touched as one commit and sync it right away.
+ */
+void pagerCommitTransaction(Pager* pager) {
+    pager -> inTransaction = false;
+    pagerCommit(pager);
+    pagerSync(pager);
+}
+
+/*
+ * Put back the before-image of every page the transaction modified and drop
+ * the pages it allocated. Old pages are restored first, which unlinks the new
+ * ones from the tree, and each new page is only dropped once the readers that
+ * were already inside it have left.
+ */
+void pagerRollback(Pager* pager) {
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < pager -> numUncommitted; i++) {
+            Frame* frame = pager -> uncommittedFrames[i];
+            int32_t frameIndex = (int32_t) (frame - pager -> frames);
+            bool allocated = frame -> pageNum >= pager -> transactionPages;
+            if (allocated != (pass == 1)) {
+                continue;
+            }
+            pthread_rwlock_wrlock(&(frame -> latch));
+            pthread_mutex_lock(&(pager -> lock));
+            frame -> uncommitted = false;
+            if (allocated) {
+                pageTableRemove(pager, frameIndex);
+                frame -> valid = false;
+                frame -> dirty = false;
+            } else {
+                memcpy(frame -> data, pager -> undoMemory + (size_t) frameIndex * PAGE_SIZE, PAGE_SIZE);
+            }
+            pthread_mutex_unlock(&(pager -> lock));
+            pthread_rwlock_unlock(&(frame -> latch));
+        }
+    }
+    pager -> numUncommitted = 0;
+    pager -> numPages = pager -> transactionPages;
+    pager -> inTransaction = false;
+}
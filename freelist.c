@@ -0,0 +1,91 @@
+#include "fileOperations.c"
+
+/*
+ * Page 0 points at the catalog page, which lists each column's index root and
+ * the first page of the free list. Pages a delete empties are chained from
+ * there through the first bytes of each free page, and new nodes are taken
+ * off the chain before the file grows. The chain lives in ordinary pages, so
+ * it is logged, committed and rolled back along with the tree.
+ */
+
+uint32_t catalogPageNum(Pager* pager) {
+    void* root = getPageLatched(pager, 0, false);
+    uint32_t pageNum = *((uint32_t*) (root + ROOT_CATALOG_PAGE_OFFSET));
+    unlatchPage(pager, root);
+    return pageNum;
+}
+
+/*
+ * Return the catalog page, appending an empty one first if there is none.
+ * The new page is zeroed before page 0 starts pointing at it, so readers never
+ * follow the pointer to a page that doesn't exist yet. Latches page 0, so the
+ * caller must not hold tree latches.
+ */
+uint32_t catalogCreate(Pager* pager) {
+    uint32_t catalog = catalogPageNum(pager);
+    if (catalog != 0) {
+        return catalog;
+    }
+    catalog = pager -> numPages;
+    void* page = getPageLatched(pager, catalog, true);
+    markPageDirty(pager, catalog);
+    memset(page, 0, PAGE_SIZE);
+    unlatchPage(pager, page);
+
+    void* root = getPageLatched(pager, 0, true);
+    markPageDirty(pager, 0);
+    *((uint32_t*) (root + ROOT_CATALOG_PAGE_OFFSET)) = catalog;
+    unlatchPage(pager, root);
+    return catalog;
+}
+
+/*
+ * The catalog pointer as the writer sees it. Splits and merges allocate and
+ * free pages while page 0 may already be latched exclusively by the same
+ * thread, so this reads it without a latch; nobody else changes it.
+ */
+uint32_t freeListCatalog(Pager* pager) {
+    void* root = getPage(pager, 0);
+    uint32_t catalog = *((uint32_t*) (root + ROOT_CATALOG_PAGE_OFFSET));
+    unpinPage(pager, 0);
+    return catalog;
+}
+
+/*
+ * Put pageNum at the head of the free list. The catalog must already exist.
+ */
+void freeListPush(Pager* pager, uint32_t pageNum) {
+    uint32_t catalog = freeListCatalog(pager);
+    void* page = getPage(pager, pageNum);
+    void* catalogPage = getPageLatched(pager, catalog, true);
+    uint32_t* head = (uint32_t*) (catalogPage + CATALOG_FREE_HEAD_OFFSET);
+    markPageDirty(pager, pageNum);
+    markPageDirty(pager, catalog);
+    *((uint32_t*) (page + FREE_PAGE_NEXT_OFFSET)) = *head;
+    *head = pageNum;
+    unlatchPage(pager, catalogPage);
+    unpinPage(pager, pageNum);
+    engineStats.pagesFreed++;
+}
+
+/*
+ * Take the page at the head of the free list, or return 0 if it is empty.
+ */
+uint32_t freeListPop(Pager* pager) {
+    uint32_t catalog = freeListCatalog(pager);
+    if (catalog == 0) {
+        return 0;
+    }
+    void* catalogPage = getPageLatched(pager, catalog, true);
+    uint32_t* head = (uint32_t*) (catalogPage + CATALOG_FREE_HEAD_OFFSET);
+    uint32_t pageNum = *head;
+    if (pageNum != 0) {
+        void* page = getPage(pager, pageNum);
+        markPageDirty(pager, catalog);
+        *head = *((uint32_t*) (page + FREE_PAGE_NEXT_OFFSET));
+        unpinPage(pager, pageNum);
+        engineStats.pagesReused++;
+    }
+    unlatchPage(pager, catalogPage);
+    return pageNum;
+}
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "db.c"
+
+/*
+ * Bulk load for an empty table. Rows are sorted in memory-sized runs, spilled
+ * to temporary files when the input doesn't fit in one, and merged straight
+ * into packed leaves. Internal levels are then built from the (page, max key,
+ * row count) list of the level below, so every page is written once, in file order.
+ */
+
+typedef struct {
+    uint32_t pageNum;
+    uint32_t maxKey;
+    uint32_t rowCount;
+} ImportChild;
+
+typedef struct {
+    Pager* pager;
+    uint32_t nextPageNum;
+    uint32_t firstBufferedPageNum;
+    uint32_t numBuffered;
+    void* buffer;
+} PageWriter;
+
+typedef struct {
+    FILE* file;
+    Row head;
+} ImportRun;
+
+void pageWriterFlush(PageWriter* writer) {
+    if (writer -> numBuffered == 0) {
+        return;
+    }
+    size_t length = (size_t) writer -> numBuffered * PAGE_SIZE;
+    off_t offset = (off_t) writer -> firstBufferedPageNum * PAGE_SIZE;
+    while (length > 0) {
+        ssize_t bytesWritten = pwrite(writer -> pager -> fileDescriptor,
+                                      writer -> buffer + ((size_t) writer -> numBuffered * PAGE_SIZE - length),
+                                      length, offset);
+        if (bytesWritten == -1) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        engineStats.writeCalls++;
+        engineStats.bytesWritten += bytesWritten;
+        length -= bytesWritten;
+        offset += bytesWritten;
+    }
+    engineStats.pagesWritten += writer -> numBuffered;
+    writer -> firstBufferedPageNum = writer -> nextPageNum;
+    writer -> numBuffered = 0;
+}
+
+/*
+ * Hand out the next page of the file as a zeroed buffer. It reaches the file
+ * together with its neighbours once the batch is full.
+ */
+void* pageWriterNext(PageWriter* writer, uint32_t* pageNum) {
+    if (writer -> numBuffered == IMPORT_WRITE_BATCH_PAGES) {
+        pageWriterFlush(writer);
+    }
+    void* page = writer -> buffer + (size_t) writer -> numBuffered * PAGE_SIZE;
+    memset(page, 0, PAGE_SIZE);
+    writer -> numBuffered++;
+    *pageNum = writer -> nextPageNum++;
+    return page;
+}
+
+/*
+ * Split one line into a row. Returns false if it isn't a valid id,username,email record.
+ */
+bool importParseLine(char* line, char delimiter, Row* row) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char* username = strchr(line, delimiter);
+    if (username == NULL) {
+        return false;
+    }
+    *username++ = '\0';
+    char* email = strchr(username, delimiter);
+    if (email == NULL) {
+        return false;
+    }
+    *email++ = '\0';
+
+    char* end;
+    errno = 0;
+    long id = strtol(line, &end, 10);
+    if (end == line || *end != '\0' || errno != 0 || id < 0 || id > UINT32_MAX) {
+        return false;
+    }
+    if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE) {
+        return false;
+    }
+    row -> id = (uint32_t) id;
+    strcpy(row -> username, username);
+    strcpy(row -> email, email);
+    return true;
+}
+
+bool importReadRun(ImportRun* run) {
+    return fread(&(run -> head), sizeof(Row), 1, run -> file) == 1;
+}
+
+void importSiftDown(ImportRun** heap, uint32_t heapSize, uint32_t index) {
+    for (;;) {
+        uint32_t smallest = index;
+        uint32_t left = 2 * index + 1;
+        uint32_t right = left + 1;
+        if (left < heapSize && heap[left] -> head.id < heap[smallest] -> head.id) {
+            smallest = left;
+        }
+        if (right < heapSize && heap[right] -> head.id < heap[smallest] -> head.id) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        ImportRun* swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+/*
+ * Write the level above children, packing fanout children per node and
+ * spreading them evenly so the last node isn't left nearly empty. The single
+ * node of the top level is the root and goes to page 0.
+ */
+uint32_t importBuildLevel(PageWriter* writer, ImportChild* children, uint32_t numChildren, uint32_t fanout, void* root) {
+    uint32_t numNodes = (numChildren + fanout - 1) / fanout;
+    uint32_t base = numChildren / numNodes;
+    uint32_t extra = numChildren % numNodes;
+
+    uint32_t next = 0;
+    for (uint32_t n = 0; n < numNodes; n++) {
+        uint32_t count = base + (n < extra ? 1 : 0);
+        uint32_t pageNum = 0;
+        void* node = (numNodes == 1) ? root : pageWriterNext(writer, &pageNum);
+        initializeInternalNode(node);
+        setNodeRoot(node, numNodes == 1);
+        *internalNodeNumKeys(node) = count - 1;
+        for (uint32_t i = 0; i < count - 1; i++) {
+            *internalNodeCell(node, i) = children[next + i].pageNum;
+            *internalNodeKey(node, i) = children[next + i].maxKey;
+        }
+        *internalNodeRightChild(node) = children[next + count - 1].pageNum;
+        uint32_t rowCount = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            *internalNodeRowCount(node, i) = children[next + i].rowCount;
+            rowCount += children[next + i].rowCount;
+        }
+
+        // Reuse the front of the array for this level's entries
+        children[n].maxKey = children[next + count - 1].maxKey;
+        children[n].rowCount = rowCount;
+        children[n].pageNum = pageNum;
+        next += count;
+    }
+    return numNodes;
+}
+
+void importFile(Table* table, const char* filename, uint32_t fillPercent, FILE* messages) {
+    Pager* pager = table -> pager;
+    if (pager -> inTransaction) {
+        fprintf(messages, "Error: Cannot import inside a transaction.\n");
+        return;
+    }
+    void* rootNode = getPage(pager, table -> rootPageNum);
+    bool empty = getNodeType(rootNode) == NODE_LEAF && *leafNodeNumCells(rootNode) == 0;
+    unpinPage(pager, table -> rootPageNum);
+    if (!empty) {
+        fprintf(messages, "Error: .import requires an empty table.\n");
+        return;
+    }
+    // Rewriting the root drops the catalog, so it may only be empty; the leaves bypass index maintenance
+    uint32_t catalog = catalogPageNum(pager);
+    if (catalog != 0) {
+        bool indexed = false;
+        for (Column column = 0; column < NUM_INDEXABLE_COLUMNS; column++) {
+            indexed = indexed || indexRootPageNum(pager, column) != 0;
+        }
+        void* catalogPage = getPageLatched(pager, catalog, false);
+        bool freePages = *((uint32_t*) (catalogPage + CATALOG_FREE_HEAD_OFFSET)) != 0;
+        unlatchPage(pager, catalogPage);
+        if (indexed) {
+            fprintf(messages, "Error: .import requires a table without indexes; create them afterwards.\n");
+            return;
+        }
+        if (freePages) {
+            // Deletes left a free list behind, and the new pages would be written over it
+            fprintf(messages, "Error: .import requires a new database file.\n");
+            return;
+        }
+    }
+
+    FILE* input = fopen(filename, "r");
+    if (input == NULL) {
+        fprintf(messages, "Error: Could not open '%s'.\n", filename);
+        return;
+    }
+    setvbuf(input, NULL, _IOFBF, IMPORT_READ_BUFFER_SIZE);
+
+    // Phase 1: sorted runs
+    Row* runRows = (Row*) malloc(IMPORT_RUN_ROWS * sizeof(Row));
+    uint32_t numRunRows = 0;
+    ImportRun* runs = NULL;
+    uint32_t numRuns = 0;
+    uint64_t numRows = 0;
+
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    uint64_t lineNum = 0;
+    char delimiter = 0;
+    bool failed = false;
+    while (getline(&line, &lineCapacity, input) != -1) {
+        lineNum++;
+        if (line[0] == '\n' || (line[0] == '\r' && line[1] == '\n')) {
+            continue;
+        }
+        if (delimiter == 0) {
+            delimiter = strchr(line, '\t') != NULL ? '\t' : ',';
+        }
+        if (!importParseLine(line, delimiter, &(runRows[numRunRows]))) {
+            // A leading header row is the only line allowed not to parse
+            if (lineNum == 1) {
+                continue;
+            }
+            fprintf(messages, "Error: Could not parse line %llu of '%s'.\n", (unsigned long long) lineNum, filename);
+            failed = true;
+            break;
+        }
+        numRunRows++;
+        numRows++;
+
+        if (numRunRows == IMPORT_RUN_ROWS) {
+            qsort(runRows, numRunRows, sizeof(Row), compareRowsById);
+            runs = (ImportRun*) realloc(runs, (numRuns + 1) * sizeof(ImportRun));
+            runs[numRuns].file = tmpfile();
+            if (runs[numRuns].file == NULL
+                || fwrite(runRows, sizeof(Row), numRunRows, runs[numRuns].file) != numRunRows) {
+                printf("Error: Could not spill a sorted run: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            numRuns++;
+            numRunRows = 0;
+        }
+    }
+    free(line);
+    fclose(input);
+    if (failed) {
+        for (uint32_t i = 0; i < numRuns; i++) {
+            fclose(runs[i].file);
+        }
+        free(runs);
+        free(runRows);
+        return;
+    }
+    qsort(runRows, numRunRows, sizeof(Row), compareRowsById);
+
+    // Start from a clean log so nothing replays over the new pages
+    pagerCommit(pager);
+    pagerCheckpoint(pager);
+
+    // Phase 2: merge the runs straight into leaves
+    ImportRun** heap = (ImportRun**) malloc((numRuns + 1) * sizeof(ImportRun*));
+    uint32_t heapSize = 0;
+    for (uint32_t i = 0; i < numRuns; i++) {
+        rewind(runs[i].file);
+        setvbuf(runs[i].file, NULL, _IOFBF, IMPORT_RUN_BUFFER_SIZE);
+        if (importReadRun(&(runs[i]))) {
+            heap[heapSize++] = &(runs[i]);
+        }
+    }
+    for (int64_t i = (int64_t) heapSize / 2 - 1; i >= 0; i--) {
+        importSiftDown(heap, heapSize, (uint32_t) i);
+    }
+    uint32_t memoryIndex = 0;
+
+    PageWriter writer;
+    writer.pager = pager;
+    writer.nextPageNum = table -> rootPageNum + 1;
+    writer.firstBufferedPageNum = writer.nextPageNum;
+    writer.numBuffered = 0;
+    writer.buffer = malloc((size_t) IMPORT_WRITE_BATCH_PAGES * PAGE_SIZE);
+
+    uint32_t leafFillBytes = LEAF_NODE_SPACE_FOR_CELLS * fillPercent / 100;
+    uint32_t childCapacity = 1024;
+    uint32_t numChildren = 0;
+    ImportChild* children = (ImportChild*) malloc(childCapacity * sizeof(ImportChild));
+
+    void* leaf = NULL;
+    uint32_t leafPageNum = 0;
+    uint64_t numImported = 0;
+    uint64_t numDuplicates = 0;
+    bool haveLast = false;
+    uint32_t lastId = 0;
+    for (;;) {
+        Row* row;
+        bool fromMemory = memoryIndex < numRunRows
+                          && (heapSize == 0 || runRows[memoryIndex].id <= heap[0] -> head.id);
+        if (fromMemory) {
+            row = &(runRows[memoryIndex]);
+        } else if (heapSize > 0) {
+            row = &(heap[0] -> head);
+        } else {
+            break;
+        }
+
+        if (haveLast && row -> id == lastId) {
+            numDuplicates++;
+        } else {
+            uint32_t cellSize = rowCellSize(row);
+            bool leafFull = leaf == NULL
+                            || leafNodeFreeSpace(leaf) < cellSize + LEAF_NODE_SLOT_SIZE
+                            || (*leafNodeNumCells(leaf) > 0
+                                && LEAF_NODE_SPACE_FOR_CELLS - leafNodeFreeSpace(leaf) + cellSize + LEAF_NODE_SLOT_SIZE > leafFillBytes);
+            if (leafFull) {
+                leaf = pageWriterNext(&writer, &leafPageNum);
+                initializeLeafNode(leaf);
+                // Leaves are laid out back to back, so the sibling is the next page
+                *leafNodeNextLeaf(leaf) = leafPageNum + 1;
+                if (numChildren == childCapacity) {
+                    childCapacity *= 2;
+                    children = (ImportChild*) realloc(children, childCapacity * sizeof(ImportChild));
+                }
+                children[numChildren].pageNum = leafPageNum;
+                children[numChildren].rowCount = 0;
+                numChildren++;
+            }
+            serializeRow(row, leafNodeAllocateCell(leaf, *leafNodeNumCells(leaf), row -> id, cellSize));
+            children[numChildren - 1].maxKey = row -> id;
+            children[numChildren - 1].rowCount++;
+            haveLast = true;
+            lastId = row -> id;
+            numImported++;
+        }
+
+        if (fromMemory) {
+            memoryIndex++;
+        } else {
+            if (!importReadRun(heap[0])) {
+                heap[0] = heap[--heapSize];
+            }
+            importSiftDown(heap, heapSize, 0);
+        }
+    }
+    if (leaf != NULL) {
+        *leafNodeNextLeaf(leaf) = 0;
+    }
+    for (uint32_t i = 0; i < numRuns; i++) {
+        fclose(runs[i].file);
+    }
+    free(runs);
+    free(heap);
+    free(runRows);
+
+    // Phase 3: internal levels, bottom-up, ending in the root on page 0
+    void* newRoot = malloc(PAGE_SIZE);
+    memset(newRoot, 0, PAGE_SIZE);
+    if (numChildren <= 1) {
+        // Everything fit in one leaf: it becomes the root instead
+        initializeLeafNode(newRoot);
+        if (numChildren == 1) {
+            memcpy(newRoot, leaf, PAGE_SIZE);
+        }
+        writer.numBuffered = 0;
+        writer.nextPageNum = table -> rootPageNum + 1;
+        setNodeRoot(newRoot, true);
+    } else {
+        uint32_t fanout = INTERNAL_NODE_MAX_CELLS * fillPercent / 100 + 1;
+        if (fanout < 2) {
+            fanout = 2;
+        }
+        while (numChildren > 1) {
+            numChildren = importBuildLevel(&writer, children, numChildren, fanout, newRoot);
+        }
+    }
+    pageWriterFlush(&writer);
+    free(writer.buffer);
+    free(children);
+
+    // The new pages must be durable before the root starts pointing at them
+    if (fsync(pager -> fileDescriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    engineStats.syncCalls++;
+    uint64_t fileLength = (uint64_t) writer.nextPageNum * PAGE_SIZE;
+    if (fileLength > pager -> fileLength) {
+        pager -> fileLength = fileLength;
+    }
+    pager -> numPages = writer.nextPageNum;
+
+    // Readers see the loaded tree only once the root is swapped in whole
+    void* root = getPageLatched(pager, table -> rootPageNum, true);
+    markPageDirty(pager, table -> rootPageNum);
+    memcpy(root, newRoot, PAGE_SIZE);
+    unlatchPage(pager, root);
+    free(newRoot);
+    pagerCommit(pager);
+    pagerCheckpoint(pager);
+
+    fprintf(messages, "Imported %llu rows.\n", (unsigned long long) numImported);
+    if (numDuplicates > 0) {
+        fprintf(messages, "Skipped %llu duplicate ids.\n", (unsigned long long) numDuplicates);
+    }
+}
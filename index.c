@@ -0,0 +1,222 @@
+#include "btree.c"
+
+/*
+ * A secondary index is a second B+tree in the same file. Its keys are a hash
+ * of the column value, so it shares all of the table's node code; entries with
+ * equal hashes sit next to each other and the value stored in each cell tells
+ * them apart. The second field of a cell is the id of the row it points at.
+ */
+
+uint32_t indexKeyHash(const char* value) {
+    uint32_t hash = 2166136261u;
+    for (const uint8_t* c = (const uint8_t*) value; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t indexCellSize(const char* value) {
+    return 2 * LEAF_NODE_STRING_LENGTH_SIZE + strlen(value) + sizeof(uint32_t);
+}
+
+void serializeIndexCell(const char* value, uint32_t id, void* destination) {
+    uint8_t valueLength = (uint8_t) strlen(value);
+    uint8_t* cell = (uint8_t*) destination;
+    *cell++ = valueLength;
+    memcpy(cell, value, valueLength);
+    cell += valueLength;
+    *cell++ = sizeof(uint32_t);
+    memcpy(cell, &id, sizeof(uint32_t));
+}
+
+/*
+ * create index on users(<column>)
+ */
+PrepareResult prepareCreateIndex(Lexer* lexer, Statement* statement) {
+    statement -> type = STATEMENT_CREATE_INDEX;
+    if (!tokenIs(lexerNext(lexer), "index") || !tokenIs(lexerNext(lexer), "on")
+        || !tokenIs(lexerNext(lexer), "users") || !tokenIs(lexerNext(lexer), "(")) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    PrepareResult result = tokenToColumn(lexerNext(lexer), &(statement -> column));
+    if (result != PREPARE_SUCCESS) {
+        return result;
+    }
+    if (!tokenIs(lexerNext(lexer), ")") || !lexerAtEnd(lexer)) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+const char* columnValue(Row* row, Column column) {
+    return column == COLUMN_USERNAME ? row -> username : row -> email;
+}
+
+/*
+ * Root page of the index on column, or 0 if the column isn't indexed.
+ */
+uint32_t indexRootPageNum(Pager* pager, Column column) {
+    uint32_t catalog = catalogPageNum(pager);
+    if (catalog == 0) {
+        return 0;
+    }
+    void* page = getPageLatched(pager, catalog, false);
+    uint32_t rootPageNum = *((uint32_t*) (page + column * CATALOG_ROOT_SIZE));
+    unlatchPage(pager, page);
+    return rootPageNum;
+}
+
+void setIndexRootPageNum(Pager* pager, Column column, uint32_t rootPageNum) {
+    uint32_t catalog = catalogCreate(pager);
+    void* page = getPageLatched(pager, catalog, true);
+    markPageDirty(pager, catalog);
+    *((uint32_t*) (page + column * CATALOG_ROOT_SIZE)) = rootPageNum;
+    unlatchPage(pager, page);
+}
+
+/*
+ * Point index at the tree of column. Returns false if there is no such index.
+ */
+bool tableIndex(Table* table, Column column, Table* index) {
+    index -> pager = table -> pager;
+    index -> rootPageNum = indexRootPageNum(table -> pager, column);
+    return index -> rootPageNum != 0;
+}
+
+bool indexInsert(Cursor* cursor, const char* value, uint32_t id) {
+    uint8_t cell[LEAF_NODE_MAX_CELL_SIZE];
+    serializeIndexCell(value, id, cell);
+    return leafNodeInsertCell(cursor, indexKeyHash(value), cell, indexCellSize(value));
+}
+
+/*
+ * Remove the entry pointing at row id from the index on value. Entries
+ * sharing the value's hash can run on over several leaves, so the cursor
+ * steps along them until it finds the one with this id. Returns false if
+ * there is none.
+ */
+bool indexDelete(Table* index, const char* value, uint32_t id) {
+    Pager* pager = index -> pager;
+    uint32_t key = indexKeyHash(value);
+    uint8_t cell[LEAF_NODE_MAX_CELL_SIZE];
+    uint32_t cellSize = indexCellSize(value);
+    serializeIndexCell(value, id, cell);
+
+    Cursor* cursor = tableFind(index, key);
+    bool found = false;
+    bool pastKey = false;
+    while (!found && !pastKey && cursorSkipLeafEnd(cursor)) {
+        void* node = getPageLatched(pager, cursor -> pageNum, false);
+        uint32_t numCells = *leafNodeNumCells(node);
+        for (; cursor -> cellNum < numCells; cursor -> cellNum++) {
+            if (*leafNodeKey(node, cursor -> cellNum) != key) {
+                pastKey = true;
+                break;
+            }
+            if (leafNodeCellSize(node, cursor -> cellNum) == cellSize
+                && memcmp(leafNodeCell(node, cursor -> cellNum), cell, cellSize) == 0) {
+                found = true;
+                break;
+            }
+        }
+        unlatchPage(pager, node);
+    }
+    if (found) {
+        leafNodeDelete(cursor, 1);
+    }
+    free(cursor);
+    return found;
+}
+
+/*
+ * Index leaves read through a RowBatch carry each entry's value where a row's
+ * username would be and the row id, as four bytes, where its email would be.
+ */
+bool indexBatchMatches(RowBatch* batch, uint32_t i, const char* value, size_t valueLength) {
+    return batch -> usernameLengths[i] == valueLength && memcmp(batch -> usernames[i], value, valueLength) == 0;
+}
+
+uint32_t indexBatchRowId(RowBatch* batch, uint32_t i) {
+    uint32_t id;
+    memcpy(&id, batch -> emails[i], sizeof(uint32_t));
+    return id;
+}
+
+typedef struct {
+    uint32_t key;
+    uint32_t id;
+} IndexBuildEntry;
+
+int compareIndexBuildEntries(const void* a, const void* b) {
+    const IndexBuildEntry* left = (const IndexBuildEntry*) a;
+    const IndexBuildEntry* right = (const IndexBuildEntry*) b;
+    if (left -> key != right -> key) {
+        return (left -> key > right -> key) - (left -> key < right -> key);
+    }
+    return (left -> id > right -> id) - (left -> id < right -> id);
+}
+
+/*
+ * Build an index on column from the rows already in the table. Entries are
+ * added in key order so each one lands in the leaf the last one did. Pages
+ * are committed as the pool fills, and the catalog only points at the tree
+ * once it is complete.
+ */
+void createIndex(Table* table, Column column) {
+    Pager* pager = table -> pager;
+    Table index;
+    index.pager = pager;
+    index.rootPageNum = getUnusedPageNum(pager);
+    void* root = getPage(pager, index.rootPageNum);
+    markPageDirty(pager, index.rootPageNum);
+    initializeLeafNode(root);
+    setNodeRoot(root, true);
+    unpinPage(pager, index.rootPageNum);
+
+    uint32_t numEntries = 0;
+    uint32_t entryCapacity = 1024;
+    IndexBuildEntry* entries = (IndexBuildEntry*) malloc(entryCapacity * sizeof(IndexBuildEntry));
+    RowBatch batch = { 0 };
+    char value[COLUMN_EMAIL_SIZE + 1];
+    Cursor* scan = tableStart(table);
+    while (cursorNextBatch(scan, &batch)) {
+        const char** strings = column == COLUMN_USERNAME ? batch.usernames : batch.emails;
+        uint8_t* lengths = column == COLUMN_USERNAME ? batch.usernameLengths : batch.emailLengths;
+        if (numEntries + batch.numRows > entryCapacity) {
+            entryCapacity *= 2;
+            entries = (IndexBuildEntry*) realloc(entries, entryCapacity * sizeof(IndexBuildEntry));
+        }
+        for (uint32_t i = 0; i < batch.numRows; i++) {
+            memcpy(value, strings[i], lengths[i]);
+            value[lengths[i]] = '\0';
+            entries[numEntries].key = indexKeyHash(value);
+            entries[numEntries].id = batch.ids[i];
+            numEntries++;
+        }
+    }
+    free(scan);
+
+    Row row;
+    qsort(entries, numEntries, sizeof(IndexBuildEntry), compareIndexBuildEntries);
+
+    Cursor* cursor = NULL;
+    for (uint32_t i = 0; i < numEntries; i++) {
+        tableFindRow(table, entries[i].id, &row);
+        if (cursor == NULL) {
+            cursor = tableFind(&index, entries[i].key);
+        } else {
+            cursorSeekForward(cursor, entries[i].key);
+        }
+        if (!pagerHasRoom(pager, 2 * cursor -> depth + 4)) {
+            pagerCommit(pager);
+        }
+        if (indexInsert(cursor, columnValue(&row, column), row.id)) {
+            free(cursor);
+            cursor = NULL;
+        }
+    }
+    free(cursor);
+    free(entries);
+
+    setIndexRootPageNum(pager, column, index.rootPageNum);
+}
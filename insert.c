@@ -1,35 +1,75 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "constants.h"
+#include "tokenizer.c"
 
-PrepareResult prepareInsert(InputBuffer* inputBuffer, Statement* statement) {
-    statement->type = STATEMENT_INSERT;
-
-    char* keyword = strtok(inputBuffer->buffer, " ");
-    char* idStr = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
+int compareRowsById(const void* a, const void* b) {
+    uint32_t left = ((Row*) a) -> id;
+    uint32_t right = ((Row*) b) -> id;
+    return (left > right) - (left < right);
+}
 
-    if (idStr == NULL || username == NULL || email == NULL) {
-        return PREPARE_SYNTAX_ERROR;
+Row* statementAddRow(Statement* statement) {
+    if (statement->numRows == statement->rowCapacity) {
+        statement->rowCapacity = statement->rowCapacity == 0 ? 16 : statement->rowCapacity * 2;
+        statement->rows = (Row*) realloc(statement->rows, statement->rowCapacity * sizeof(Row));
     }
+    return &(statement->rows[statement->numRows++]);
+}
 
-    int id = atoi(idStr);
-    if (id < 0) {
-        return PREPARE_NEGATIVE_ID;
+PrepareResult parseRowValues(Token idToken, Token usernameToken, Token emailToken, Row* row) {
+    PrepareResult result = tokenToId(idToken, &(row->id));
+    if (result == PREPARE_SUCCESS) {
+        result = tokenToString(usernameToken, row->username, COLUMN_USERNAME_SIZE);
     }
-
-    if (strlen(username) > COLUMN_USERNAME_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
+    if (result == PREPARE_SUCCESS) {
+        result = tokenToString(emailToken, row->email, COLUMN_EMAIL_SIZE);
     }
+    return result;
+}
 
-    if (strlen(username) > COLUMN_USERNAME_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
+/*
+ * insert <id> <username> <email>
+ * insert values (<id>, '<username>', '<email>'), (...), ...
+ */
+PrepareResult prepareInsert(Lexer* lexer, Statement* statement) {
+    statement->type = STATEMENT_INSERT;
+    statement->numRows = 0;
+
+    Token token = lexerNext(lexer);
+    if (!tokenIs(token, "values")) {
+        Token username = lexerNext(lexer);
+        Token email = lexerNext(lexer);
+        if (token.type == TOKEN_END || username.type == TOKEN_END || email.type == TOKEN_END) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        PrepareResult result = parseRowValues(token, username, email, statementAddRow(statement));
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+        return lexerAtEnd(lexer) ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
     }
 
-    statement->rowToInsert.id = id;
-    strcpy(statement->rowToInsert.username, username);
-    strcpy(statement->rowToInsert.email, email);
-    return PREPARE_SUCCESS;
-}
\ No newline at end of file
+    for (;;) {
+        Token open = lexerNext(lexer);
+        Token id = lexerNext(lexer);
+        Token comma1 = lexerNext(lexer);
+        Token username = lexerNext(lexer);
+        Token comma2 = lexerNext(lexer);
+        Token email = lexerNext(lexer);
+        Token close = lexerNext(lexer);
+        if (!tokenIs(open, "(") || !tokenIs(comma1, ",") || !tokenIs(comma2, ",") || !tokenIs(close, ")")) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        PrepareResult result = parseRowValues(id, username, email, statementAddRow(statement));
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+
+        size_t position = lexer->position;
+        if (!tokenIs(lexerNext(lexer), ",")) {
+            lexer->position = position;
+            return lexerAtEnd(lexer) ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+        }
+    }
+}
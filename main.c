@@ -2,132 +2,275 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
-#include "db.c"
+#include <poll.h>
+#include <time.h>
+#include "server.c"
 
-InputBuffer* createInputBuffer() {
+InputBuffer* createInputBuffer(int fileDescriptor) {
     InputBuffer* inputBuffer = (InputBuffer*) malloc(sizeof(InputBuffer));
+    inputBuffer -> fileDescriptor = fileDescriptor;
+    inputBuffer -> capacity = INPUT_BUFFER_SIZE;
+    inputBuffer -> data = (char*) malloc(inputBuffer -> capacity);
+    inputBuffer -> start = 0;
+    inputBuffer -> end = 0;
+    inputBuffer -> endOfInput = false;
     inputBuffer -> buffer = NULL;
-    inputBuffer -> bufferLength = 0;
     inputBuffer -> inputLength = 0;
     return inputBuffer;
 }
 
-void printPrompt() {
-    printf("ninja > ");
-}
-
-void printRow(Row* row) {
-    printf("(%d, %s, %s)\n", row -> id, row -> username, row -> email);
-}
-
-void serializeRow(Row* source, void* destination) {
-    memcpy(destination + ID_OFFSET, &(source -> id), ID_SIZE);
-    memcpy(destination + USERNAME_OFFSET, &(source -> username), USERNAME_SIZE);
-    memcpy(destination + EMAIL_OFFSET, &(source -> email), EMAIL_SIZE);
-}
-
-void deserializeRow(void* source, Row* destination) {
-    memcpy(&(destination -> id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination -> username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination -> email), source + EMAIL_OFFSET, EMAIL_SIZE);
+/*
+ * Only interactive text output gets a prompt; it would corrupt the other formats.
+ */
+void printPrompt(ResultSink* sink) {
+    if (sink -> format == OUTPUT_TEXT && !(sink -> batch)) {
+        printf("ninja > ");
+    }
 }
 
-uint32_t* leafNodeNumCells(void* node) {
-    return (uint32_t*) (node + LEAF_NODE_NUM_CELLS_OFFSET);
+void printConstants(FILE* out) {
+    fprintf(out, "COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    fprintf(out, "LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    fprintf(out, "LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+    fprintf(out, "LEAF_NODE_MAX_CELL_SIZE: %d\n", LEAF_NODE_MAX_CELL_SIZE);
+    fprintf(out, "LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    fprintf(out, "LEAF_NODE_MIN_CELLS: %d\n", LEAF_NODE_MIN_CELLS);
+    fprintf(out, "INTERNAL_NODE_HEADER_SIZE: %d\n", INTERNAL_NODE_HEADER_SIZE);
+    fprintf(out, "INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
 }
 
-void* leafNodeCell(void* node, uint32_t cell_num) {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
-}
+void printStats(Table* table, FILE* out) {
+    EngineStats* stats = &engineStats;
+    uint64_t lookups = stats -> cacheHits + stats -> cacheMisses;
+    if (table -> pager -> mode == PAGER_MMAP) {
+        fprintf(out, "page cache: mmap\n");
+    } else {
+        fprintf(out, "page cache: %llu hits, %llu misses (%.1f%% hits), %llu evictions\n",
+               (unsigned long long) stats -> cacheHits, (unsigned long long) stats -> cacheMisses,
+               lookups > 0 ? 100.0 * (double) stats -> cacheHits / (double) lookups : 0.0,
+               (unsigned long long) stats -> evictions);
+    }
+    fprintf(out, "pages: %llu read, %llu prefetched, %llu written, %llu log frames\n",
+           (unsigned long long) stats -> pagesRead, (unsigned long long) stats -> pagesPrefetched,
+           (unsigned long long) stats -> pagesWritten, (unsigned long long) stats -> walFramesWritten);
+    fprintf(out, "bytes: %llu read, %llu written\n", (unsigned long long) stats -> bytesRead,
+           (unsigned long long) stats -> bytesWritten);
+    fprintf(out, "syscalls: %llu reads, %llu writes, %llu syncs\n", (unsigned long long) stats -> readCalls,
+           (unsigned long long) stats -> writeCalls, (unsigned long long) stats -> syncCalls);
+
+    fprintf(out, "btree: depth %u, %llu leaf splits, %llu internal splits, %llu root splits\n", tableHeight(table),
+           (unsigned long long) stats -> leafSplits, (unsigned long long) stats -> internalSplits,
+           (unsigned long long) stats -> rootSplits);
+    fprintf(out, "rebalancing: %llu merges, %llu redistributions, %llu root collapses\n",
+           (unsigned long long) stats -> nodeMerges, (unsigned long long) stats -> nodeRedistributions,
+           (unsigned long long) stats -> rootCollapses);
+    fprintf(out, "free pages: %llu freed, %llu reused\n", (unsigned long long) stats -> pagesFreed,
+           (unsigned long long) stats -> pagesReused);
+    fprintf(out, "updates: %llu in place, %llu relocated\n", (unsigned long long) stats -> updatesInPlace,
+           (unsigned long long) stats -> updatesRelocated);
+    const char* columnNames[NUM_INDEXABLE_COLUMNS] = { "username", "email" };
+    for (Column column = 0; column < NUM_INDEXABLE_COLUMNS; column++) {
+        Table index;
+        if (tableIndex(table, column, &index)) {
+            fprintf(out, "index on %s: depth %u\n", columnNames[column], tableHeight(&index));
+        }
+    }
+    fprintf(out, "rows: %llu scanned, %llu returned\n", (unsigned long long) stats -> rowsScanned,
+           (unsigned long long) stats -> rowsReturned);
 
-uint32_t* leafNodeKey(void* node, uint32_t cell_num) {
-    return (uint32_t*) leafNodeCell(node, cell_num);
+    for (uint32_t type = 0; type < NUM_STATEMENT_TYPES; type++) {
+        if (stats -> statements[type] == 0) {
+            continue;
+        }
+        fprintf(out, "%s: %llu statements, mean %.3fus\n", STATEMENT_NAMES[type],
+                (unsigned long long) stats -> statements[type],
+                (double) stats -> statementNanoseconds[type] / 1000.0 / (double) stats -> statements[type]);
+        for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++) {
+            uint64_t count = stats -> latency[type][bucket];
+            if (count == 0) {
+                continue;
+            }
+            if (bucket == 0) {
+                fprintf(out, "  < 1us: %llu\n", (unsigned long long) count);
+            } else if (bucket == STATS_LATENCY_BUCKETS - 1) {
+                fprintf(out, "  >= %lluus: %llu\n", 1ull << (bucket - 1), (unsigned long long) count);
+            } else {
+                fprintf(out, "  %llu-%lluus: %llu\n", 1ull << (bucket - 1), (1ull << bucket) - 1,
+                        (unsigned long long) count);
+            }
+        }
+    }
 }
 
-void* leafNodeValue(void* node, uint32_t cell_num) {
-    return leafNodeCell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+void indent(FILE* out, uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        fprintf(out, "  ");
+    }
 }
 
-
-Cursor* tableStart(Table* table) {
-    Cursor* cursor = (Cursor*) malloc(sizeof(Cursor));
-    cursor -> table = table;
-    cursor -> pageNum = table -> rootPageNum;
-    cursor -> cellNum = 0;
-
-    void* root_node = getPage(table -> pager, table -> rootPageNum);
-    uint32_t num_cells = *leafNodeNumCells(root_node);
-    cursor -> endOfTable = (num_cells == 0);
-    return cursor;
+void printTree(FILE* out, Pager* pager, uint32_t pageNum, uint32_t indentationLevel) {
+    void* node = getPage(pager, pageNum);
+    uint32_t numKeys, child;
+
+    switch (getNodeType(node)) {
+        case (NODE_LEAF):
+            numKeys = *leafNodeNumCells(node);
+            indent(out, indentationLevel);
+            fprintf(out, "- leaf (size %d)\n", numKeys);
+            for (uint32_t i = 0; i < numKeys; i++) {
+                indent(out, indentationLevel + 1);
+                fprintf(out, "- %d\n", *leafNodeKey(node, i));
+            }
+            break;
+        case (NODE_INTERNAL):
+            numKeys = *internalNodeNumKeys(node);
+            indent(out, indentationLevel);
+            fprintf(out, "- internal (size %d)\n", numKeys);
+            for (uint32_t i = 0; i < numKeys; i++) {
+                child = *internalNodeChild(node, i);
+                printTree(out, pager, child, indentationLevel + 1);
+
+                indent(out, indentationLevel + 1);
+                fprintf(out, "- key %d\n", *internalNodeKey(node, i));
+            }
+            child = *internalNodeRightChild(node);
+            printTree(out, pager, child, indentationLevel + 1);
+            break;
+    }
+    unpinPage(pager, pageNum);
 }
 
-Cursor* tableEnd(Table* table) {
-    Cursor* cursor = (Cursor*) malloc(sizeof(Cursor));
-    cursor -> table = table;
-    cursor -> pageNum = table -> rootPageNum;
-    void* root_node = getPage(table -> pager, table -> rootPageNum);
-    uint32_t num_cells = *leafNodeNumCells(root_node);
-    cursor -> cellNum = num_cells;
-    cursor -> endOfTable = true;
-    return cursor;
+/*
+ * True if another line can be read without blocking.
+ */
+bool inputPending(InputBuffer* inputBuffer) {
+    if (memchr(inputBuffer -> data + inputBuffer -> start, '\n', inputBuffer -> end - inputBuffer -> start) != NULL) {
+        return true;
+    }
+    struct pollfd sourcePoll = { inputBuffer -> fileDescriptor, POLLIN, 0 };
+    return poll(&sourcePoll, 1, 0) == 1 && (sourcePoll.revents & POLLHUP) == 0;
 }
 
-void* cursorValue(Cursor* cursor) {
-    uint32_t pageNum = cursor -> pageNum;
-    void* page = getPage(cursor -> table -> pager, pageNum);
-    return leafNodeValue(page, cursor -> cellNum);
-}
+/*
+ * Point buffer at the next line, reading another chunk when no full line is
+ * left. Returns false at the end of the input.
+ */
+bool inputNextLine(InputBuffer* inputBuffer) {
+    for (;;) {
+        char* lineStart = inputBuffer -> data + inputBuffer -> start;
+        size_t available = inputBuffer -> end - inputBuffer -> start;
+        char* newline = (char*) memchr(lineStart, '\n', available);
+        if (newline != NULL || (inputBuffer -> endOfInput && available > 0)) {
+            // The last line of a script may not end in a newline
+            size_t length = newline != NULL ? (size_t) (newline - lineStart) : available;
+            inputBuffer -> start += newline != NULL ? length + 1 : length;
+            if (length > 0 && lineStart[length - 1] == '\r') {
+                length--;
+            }
+            lineStart[length] = '\0';
+            inputBuffer -> buffer = lineStart;
+            inputBuffer -> inputLength = (ssize_t) length;
+            return true;
+        }
+        if (inputBuffer -> endOfInput) {
+            return false;
+        }
 
-void cursorAdvance(Cursor* cursor) {
-    uint32_t page_num = cursor -> pageNum;
-    void* node = getPage(cursor->table->pager, page_num);
-    cursor -> cellNum += 1;
-    if (cursor -> cellNum >= (*leafNodeNumCells(node))) {
-        cursor->endOfTable = true;
+        memmove(inputBuffer -> data, lineStart, available);
+        inputBuffer -> start = 0;
+        inputBuffer -> end = available;
+        // Keep a byte spare for the terminator of an unterminated last line
+        if (inputBuffer -> end + 1 >= inputBuffer -> capacity) {
+            inputBuffer -> capacity *= 2;
+            inputBuffer -> data = (char*) realloc(inputBuffer -> data, inputBuffer -> capacity);
+        }
+        ssize_t bytesRead = read(inputBuffer -> fileDescriptor, inputBuffer -> data + inputBuffer -> end,
+                                 inputBuffer -> capacity - 1 - inputBuffer -> end);
+        if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            inputBuffer -> endOfInput = true;
+        } else {
+            inputBuffer -> end += bytesRead;
+        }
     }
 }
 
-void printConstants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
-}
-
-void printLeafNode(void* node) {
-    uint32_t numCells = *leafNodeNumCells(node);
-    printf("leaf (size %d)\n", numCells);
-    for (uint32_t i = 0; i < numCells; i++) {
-        uint32_t key = *leafNodeKey(node, i);
-        printf("  - %d : %d\n", i, key);
+/*
+ * Commits are only fsynced as a group: right before the REPL would block
+ * waiting for more input, or once the group is full. Output is held back
+ * the same way, so piped statements don't cost a write each.
+ * Returns false at the end of the input.
+ */
+bool readInput(InputBuffer* inputBuffer, Table* table) {
+    if (!inputPending(inputBuffer)) {
+        pagerSync(table -> pager);
+        fflush(stdout);
     }
+    return inputNextLine(inputBuffer);
 }
 
-void readInput(InputBuffer* inputBuffer) {
-    ssize_t bytesRead = getline(&(inputBuffer -> buffer), &(inputBuffer -> bufferLength), stdin);
-
-    if (bytesRead <= 0) {
-        printf("Error reading input\n");
-        exit(EXIT_FAILURE);
+/*
+ * Blank lines and -- comments, as found in scripts.
+ */
+bool isBlankInput(InputBuffer* inputBuffer) {
+    char* c = inputBuffer -> buffer;
+    while (*c == ' ' || *c == '\t') {
+        c++;
     }
+    return *c == '\0' || strncmp(c, "--", 2) == 0;
+}
 
-    inputBuffer -> inputLength = bytesRead - 1;
-    inputBuffer -> buffer[bytesRead - 1] = 0;
+double elapsedSeconds(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start -> tv_sec) + (double) (end.tv_nsec - start -> tv_nsec) / 1e9;
 }
 
-MetaCommandResult createMetaCommand(InputBuffer* inputBuffer, Table* table) {
+MetaCommandResult createMetaCommand(InputBuffer* inputBuffer, Table* table, ResultSink* sink) {
     if (strcmp(inputBuffer -> buffer, ".exit") == 0) {
         closeDB(table);
         exit(EXIT_SUCCESS);
     } else if (strcmp(inputBuffer -> buffer, ".btree") == 0) {
-        printf("Tree:\n");
-        printLeafNode(getPage(table->pager, 0));
+        fprintf(sink -> messages, "Tree:\n");
+        printTree(sink -> messages, table -> pager, table -> rootPageNum, 0);
         return META_COMMAND_SUCCESS;
     } else if (strcmp(inputBuffer -> buffer, ".constants") == 0) {
-        printf("Constants:\n");
-        printConstants();
+        fprintf(sink -> messages, "Constants:\n");
+        printConstants(sink -> messages);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(inputBuffer -> buffer, ".stats") == 0) {
+        fprintf(sink -> messages, "Stats:\n");
+        printStats(table, sink -> messages);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(inputBuffer -> buffer, ".stats reset") == 0) {
+        statsReset();
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(inputBuffer -> buffer, ".mode ", 6) == 0) {
+        OutputFormat format;
+        if (!parseOutputFormat(inputBuffer -> buffer + 6, &format)) {
+            fprintf(sink -> messages, "Usage: .mode text|csv|binary\n");
+            return META_COMMAND_SUCCESS;
+        }
+        sinkSetFormat(sink, format);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(inputBuffer -> buffer, ".timer on") == 0 || strcmp(inputBuffer -> buffer, ".timer off") == 0) {
+        sink -> timer = strcmp(inputBuffer -> buffer + 7, "on") == 0;
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(inputBuffer -> buffer, ".import ", 8) == 0) {
+        strtok(inputBuffer -> buffer, " ");
+        char* filename = strtok(NULL, " ");
+        char* fillStr = strtok(NULL, " ");
+        long fillPercent = IMPORT_DEFAULT_FILL_PERCENT;
+        if (fillStr != NULL) {
+            fillPercent = strtol(fillStr, NULL, 10);
+        }
+        if (filename == NULL || fillPercent < 1 || fillPercent > 100) {
+            fprintf(sink -> messages, "Usage: .import <file> [fill percent 1-100]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        importFile(table, filename, (uint32_t) fillPercent, sink -> messages);
         return META_COMMAND_SUCCESS;
     } else {
         return META_COMMAND_UNRECOGNIZED;
@@ -137,121 +280,604 @@ MetaCommandResult createMetaCommand(InputBuffer* inputBuffer, Table* table) {
 
 
 PrepareResult prepareStatement(InputBuffer* inputBuffer, Statement* statement) {
-    if (strncmp(inputBuffer -> buffer, "insert", 6) == 0) {
-        return prepareInsert(inputBuffer, statement);
+    Lexer lexer;
+    lexerInit(&lexer, inputBuffer -> buffer);
+    Token keyword = lexerNext(&lexer);
+
+    if (tokenIs(keyword, "insert")) {
+        return prepareInsert(&lexer, statement);
+    }
+    if (tokenIs(keyword, "delete")) {
+        return prepareDelete(&lexer, statement);
+    }
+    if (tokenIs(keyword, "update")) {
+        return prepareUpdate(&lexer, statement);
+    }
+    if (tokenIs(keyword, "select")) {
+        return prepareSelect(&lexer, statement);
+    }
+    if (tokenIs(keyword, "create")) {
+        return prepareCreateIndex(&lexer, statement);
+    }
+    if (tokenIs(keyword, "begin")) {
+        statement -> type = STATEMENT_BEGIN;
+    } else if (tokenIs(keyword, "commit")) {
+        statement -> type = STATEMENT_COMMIT;
+    } else if (tokenIs(keyword, "rollback")) {
+        statement -> type = STATEMENT_ROLLBACK;
+    } else {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    return lexerAtEnd(&lexer) ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+/*
+ * Rows go in by ascending id so that neighbours reuse the cursor instead of
+ * descending from the root again. A failing row stops the batch; the rows
+ * before it stay inserted. Every index gets its entry along with the row.
+ */
+ExecuteResult executeInsert(Statement* statement, Table* table) {
+    Pager* pager = table -> pager;
+    if (statement -> numRows > 1) {
+        qsort(statement -> rows, statement -> numRows, sizeof(Row), compareRowsById);
     }
-    if (strncmp(inputBuffer -> buffer, "select", 6) == 0) {
-        statement -> type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+
+    Table indexes[NUM_INDEXABLE_COLUMNS];
+    Column indexColumns[NUM_INDEXABLE_COLUMNS];
+    Cursor* indexCursors[NUM_INDEXABLE_COLUMNS];
+    uint32_t numIndexes = 0;
+    for (uint32_t column = 0; column < NUM_INDEXABLE_COLUMNS; column++) {
+        if (tableIndex(table, (Column) column, &(indexes[numIndexes]))) {
+            indexColumns[numIndexes++] = (Column) column;
+        }
     }
 
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+    Cursor* cursor = NULL;
+    ExecuteResult result = EXECUTE_SUCCESS;
+    for (uint32_t i = 0; i < statement -> numRows; i++) {
+        Row* rowToInsert = &(statement -> rows[i]);
+        uint32_t keyToInsert = rowToInsert -> id;
+        if (cursor == NULL) {
+            cursor = tableFind(table, keyToInsert);
+        } else {
+            cursorSeekForward(cursor, keyToInsert);
+        }
+
+        if (cursorMatchesKey(cursor, keyToInsert)) {
+            result = EXECUTE_DUPLICATE_KEY;
+            break;
+        }
+        // Worst case every level splits, plus a new root and the pages pinned meanwhile
+        uint32_t pagesNeeded = 2 * cursor -> depth + 4;
+        for (uint32_t j = 0; j < numIndexes; j++) {
+            // Index keys are hashes, so neighbouring rows rarely share an index leaf
+            indexCursors[j] = tableFind(&(indexes[j]), indexKeyHash(columnValue(rowToInsert, indexColumns[j])));
+            pagesNeeded += 2 * indexCursors[j] -> depth + 4;
+        }
+        if (!pagerHasRoom(pager, pagesNeeded) && !pager -> inTransaction) {
+            // A long batch outside a transaction commits as it goes
+            pagerCommit(pager);
+        }
+        if (!pagerHasRoom(pager, pagesNeeded)) {
+            for (uint32_t j = 0; j < numIndexes; j++) {
+                free(indexCursors[j]);
+            }
+            result = EXECUTE_TRANSACTION_FULL;
+            break;
+        }
+
+        if (leafNodeInsert(cursor, keyToInsert, rowToInsert)) {
+            free(cursor);
+            cursor = NULL;
+        }
+        for (uint32_t j = 0; j < numIndexes; j++) {
+            indexInsert(indexCursors[j], columnValue(rowToInsert, indexColumns[j]), keyToInsert);
+            free(indexCursors[j]);
+        }
+    }
+    free(cursor);
+    return result;
 }
 
-void leafNodeInsert(Cursor* cursor, uint32_t key, Row* value) {
-    void* node = getPage(cursor -> table -> pager, cursor -> pageNum);
-    uint32_t num_cells = *leafNodeNumCells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        // Node full
-        printf("Need to implement splitting a leaf node.\n");
-        exit(EXIT_FAILURE);
+/*
+ * Rows in the id range go a leaf at a time: the cursor lands on the lowest id
+ * left in the range and the run of cells up to the upper bound is cut out
+ * together. With indexes each row's entries go first, so rows are removed
+ * one by one. As with inserts, a long delete outside a transaction commits
+ * as it goes; one that runs out of room inside a transaction stops, and the
+ * rows before it stay deleted.
+ */
+ExecuteResult executeDelete(Statement* statement, Table* table) {
+    Pager* pager = table -> pager;
+    Table indexes[NUM_INDEXABLE_COLUMNS];
+    Column indexColumns[NUM_INDEXABLE_COLUMNS];
+    uint32_t numIndexes = 0;
+    for (uint32_t column = 0; column < NUM_INDEXABLE_COLUMNS; column++) {
+        if (tableIndex(table, (Column) column, &(indexes[numIndexes]))) {
+            indexColumns[numIndexes++] = (Column) column;
+        }
     }
 
-    if (cursor -> cellNum < num_cells) {
-        // Make room for new cell
-        for (uint32_t i = num_cells; i > cursor -> cellNum; i--) {
-            memcpy(leafNodeCell(node, i), leafNodeCell(node, i - 1), LEAF_NODE_CELL_SIZE);
+    ExecuteResult result = EXECUTE_SUCCESS;
+    Row row;
+    for (;;) {
+        Cursor* cursor = tableFind(table, statement -> idLow);
+        uint32_t numRows = cursorSkipLeafEnd(cursor) ? cursorCellsUpTo(cursor, statement -> idHigh) : 0;
+        if (numRows == 0) {
+            free(cursor);
+            break;
+        }
+        if (numIndexes > 0) {
+            numRows = 1;
+        }
+
+        // Worst case every level of each tree merges with a sibling, plus the catalog and the pages pinned meanwhile
+        uint32_t pagesNeeded = 2 * cursor -> depth + 4;
+        for (uint32_t j = 0; j < numIndexes; j++) {
+            pagesNeeded += 2 * tableHeight(&(indexes[j])) + 4;
         }
+        if (!pagerHasRoom(pager, pagesNeeded) && !pager -> inTransaction) {
+            pagerCommit(pager);
+        }
+        if (!pagerHasRoom(pager, pagesNeeded)) {
+            free(cursor);
+            result = EXECUTE_TRANSACTION_FULL;
+            break;
+        }
+
+        if (numIndexes > 0) {
+            cursorRow(cursor, &row);
+            for (uint32_t j = 0; j < numIndexes; j++) {
+                indexDelete(&(indexes[j]), columnValue(&row, indexColumns[j]), row.id);
+            }
+        }
+        leafNodeDelete(cursor, numRows);
+        free(cursor);
     }
+    return result;
+}
 
-    *(leafNodeNumCells(node)) += 1;
-    *(leafNodeKey(node, cursor -> cellNum)) = key;
-    serializeRow(value, leafNodeValue(node, cursor -> cellNum));
+/*
+ * Make room in the buffer pool for a step that can dirty numPages more pages.
+ * Outside a transaction the work so far is committed first if it has to be.
+ * Returns false if there is still no room.
+ */
+bool pagerReserve(Pager* pager, uint32_t numPages) {
+    if (!pagerHasRoom(pager, numPages) && !pager -> inTransaction) {
+        pagerCommit(pager);
+    }
+    return pagerHasRoom(pager, numPages);
 }
 
-ExecuteResult executeInsert(Statement* statement, Table* table) {
-    void* node = getPage(table -> pager, table -> rootPageNum);
-    if ((*leafNodeNumCells(node) >= LEAF_NODE_MAX_CELLS)) {
-        return EXECUTE_TABLE_FULL;
+/*
+ * Rows are rewritten one at a time from the lowest id up. An index only
+ * changes when its column is assigned a new value; the entry for the old
+ * value comes out and one for the new value goes in. A row that is already
+ * as assigned isn't written at all. Inside a transaction a row's steps must
+ * all fit in the buffer pool together; outside one only the largest has to,
+ * since the index deletes, the index inserts and the row rewrite may commit
+ * in between.
+ */
+ExecuteResult executeUpdate(Statement* statement, Table* table) {
+    Pager* pager = table -> pager;
+    Table indexes[NUM_INDEXABLE_COLUMNS];
+    Column indexColumns[NUM_INDEXABLE_COLUMNS];
+    uint32_t numIndexes = 0;
+    for (uint32_t column = 0; column < NUM_INDEXABLE_COLUMNS; column++) {
+        if (statement -> assigns[column] && tableIndex(table, (Column) column, &(indexes[numIndexes]))) {
+            indexColumns[numIndexes++] = (Column) column;
+        }
+    }
+
+    ExecuteResult result = EXECUTE_SUCCESS;
+    Cursor* cursor = tableFind(table, statement -> idLow);
+    Row row;
+    Row updated;
+    while (cursorSkipLeafEnd(cursor)) {
+        cursorRow(cursor, &row);
+        if (row.id > statement -> idHigh) {
+            break;
+        }
+        updated = row;
+        if (statement -> assigns[COLUMN_USERNAME]) {
+            strcpy(updated.username, statement -> assigned.username);
+        }
+        if (statement -> assigns[COLUMN_EMAIL]) {
+            strcpy(updated.email, statement -> assigned.email);
+        }
+
+        if (strcmp(row.username, updated.username) != 0 || strcmp(row.email, updated.email) != 0) {
+            // Worst case the row and each changed index entry move, splitting every level of their tree
+            uint32_t rowPages = 2 * cursor -> depth + 4;
+            uint32_t indexPages[NUM_INDEXABLE_COLUMNS];
+            uint32_t totalPages = rowPages;
+            uint32_t largestStep = rowPages;
+            for (uint32_t j = 0; j < numIndexes; j++) {
+                bool changed = strcmp(columnValue(&row, indexColumns[j]), columnValue(&updated, indexColumns[j])) != 0;
+                indexPages[j] = changed ? 2 * tableHeight(&(indexes[j])) + 4 : 0;
+                totalPages += 2 * indexPages[j];
+                largestStep = indexPages[j] > largestStep ? indexPages[j] : largestStep;
+            }
+            // Outside a transaction each step below commits the ones before it if it needs the room
+            if (!pagerReserve(pager, pager -> inTransaction ? totalPages : largestStep)) {
+                result = EXECUTE_TRANSACTION_FULL;
+                break;
+            }
+
+            for (uint32_t j = 0; j < numIndexes; j++) {
+                if (indexPages[j] > 0) {
+                    pagerReserve(pager, indexPages[j]);
+                    indexDelete(&(indexes[j]), columnValue(&row, indexColumns[j]), row.id);
+                }
+            }
+            for (uint32_t j = 0; j < numIndexes; j++) {
+                if (indexPages[j] > 0) {
+                    const char* value = columnValue(&updated, indexColumns[j]);
+                    pagerReserve(pager, indexPages[j]);
+                    Cursor* indexCursor = tableFind(&(indexes[j]), indexKeyHash(value));
+                    indexInsert(indexCursor, value, row.id);
+                    free(indexCursor);
+                }
+            }
+            pagerReserve(pager, rowPages);
+            if (leafNodeUpdate(cursor, &updated)) {
+                free(cursor);
+                if (row.id == statement -> idHigh) {
+                    cursor = NULL;
+                    break;
+                }
+                cursor = tableFind(table, row.id + 1);
+                continue;
+            }
+        }
+        if (row.id == statement -> idHigh) {
+            break;
+        }
+        cursor -> cellNum++;
     }
+    free(cursor);
+    return result;
+}
 
-    Row* rowToInsert = &(statement -> rowToInsert);
-    Cursor* cursor = tableEnd(table);
+/*
+ * Rows whose column equals the statement's value, found through the index on
+ * that column: only the entries sharing the value's hash are visited. Matches
+ * are written to sink, or added to state if it isn't NULL.
+ */
+void selectByIndex(Statement* statement, Table* table, Table* index, ResultSink* sink, AggregateState* state) {
+    Row row;
+    RowBatch batch = { 0 };
+    uint32_t key = indexKeyHash(statement -> value);
+    size_t valueLength = strlen(statement -> value);
+    bool pastKey = false;
+    Cursor* cursor = tableSeek(index, key);
+    while (!pastKey && cursorNextBatch(cursor, &batch)) {
+        for (uint32_t i = 0; i < batch.numRows && !pastKey; i++) {
+            pastKey = batch.ids[i] != key;
+            if (pastKey || !indexBatchMatches(&batch, i, statement -> value, valueLength)
+                || !tableFindRow(table, indexBatchRowId(&batch, i), &row)) {
+                continue;
+            }
+            if (state != NULL) {
+                aggregateAddId(state, row.id);
+            } else {
+                sinkWriteRow(sink, &row);
+            }
+        }
+    }
+    rowBatchRelease(table -> pager, &batch);
+    free(cursor);
+}
+
+/*
+ * Rows whose column equals the statement's value. Without an index every row
+ * is visited.
+ */
+void selectByValue(Statement* statement, Table* table, ResultSink* sink) {
+    Table index;
+    if (tableIndex(table, statement -> column, &index)) {
+        selectByIndex(statement, table, &index, sink, NULL);
+        return;
+    }
 
-    leafNodeInsert(cursor, rowToInsert -> id, rowToInsert);
+    RowBatch batch = { 0 };
+    uint32_t selected[ROW_BATCH_SIZE];
+    Cursor* cursor = tableStart(table);
+    while (cursorNextBatch(cursor, &batch)) {
+        sinkWriteBatch(sink, &batch, selected, batchSelectValue(&batch, statement -> column, statement -> value, selected));
+    }
     free(cursor);
+}
+
+/*
+ * Without a value match, everything but sum comes from the row counts in the
+ * tree. A value match on an indexed column only visits that index; the rest
+ * is a parallel scan.
+ */
+ExecuteResult executeAggregate(Statement* statement, Table* table, ResultSink* sink) {
+    AggregateState state;
+    Table index;
+    if (statement -> hasValueMatch && tableIndex(table, statement -> column, &index)) {
+        memset(&state, 0, sizeof(AggregateState));
+        selectByIndex(statement, table, &index, sink, &state);
+    } else if (!(statement -> hasValueMatch) && statement -> aggregate != AGGREGATE_SUM) {
+        countedAggregate(table, statement, &state);
+    } else {
+        parallelAggregate(table, statement, &state);
+    }
+    sinkWriteAggregate(sink, statement -> aggregate, &state);
+    sinkFlush(sink);
     return EXECUTE_SUCCESS;
 }
 
-ExecuteResult executeSelect(Statement* statement, Table* table) {
+/*
+ * Scans run a leaf at a time: each batch is filtered into a list of
+ * selected rows, and only those are written out.
+ */
+ExecuteResult executeSelect(Statement* statement, Table* table, ResultSink* sink) {
+    if (statement -> aggregate != AGGREGATE_NONE) {
+        return executeAggregate(statement, table, sink);
+    }
+    if (statement -> hasValueMatch) {
+        selectByValue(statement, table, sink);
+        sinkFlush(sink);
+        return EXECUTE_SUCCESS;
+    }
+
+    RowBatch batch = { 0 };
+    uint32_t selected[ROW_BATCH_SIZE];
+    if (statement -> hasIdRange) {
+        // Seek to the lower bound and stream along the leaves until past the upper one
+        Cursor* cursor = tableSeek(table, statement -> idLow);
+        while (cursorNextBatch(cursor, &batch)) {
+            sinkWriteBatch(sink, &batch, selected, batchSelectIdRange(&batch, statement -> idLow, statement -> idHigh, selected));
+            if (batch.ids[batch.numRows - 1] >= statement -> idHigh) {
+                break;
+            }
+        }
+        rowBatchRelease(table -> pager, &batch);
+        free(cursor);
+        sinkFlush(sink);
+        return EXECUTE_SUCCESS;
+    }
+
     Cursor* cursor = tableStart(table);
-    Row row;
-    while (!(cursor -> endOfTable)) {
-        deserializeRow(cursorValue(cursor), &row);
-        printRow(&row);
-        cursorAdvance(cursor);
+    while (cursorNextBatch(cursor, &batch)) {
+        sinkWriteBatch(sink, &batch, NULL, batch.numRows);
     }
     free(cursor);
+    sinkFlush(sink);
     return EXECUTE_SUCCESS;
 }
 
-ExecuteResult executeStatement(Statement *statement, Table* table) {
+ExecuteResult executeTransaction(Statement* statement, Table* table) {
+    Pager* pager = table -> pager;
+    if (pager -> mode == PAGER_MMAP) {
+        return EXECUTE_TRANSACTIONS_UNSUPPORTED;
+    }
+    if (statement -> type == STATEMENT_BEGIN) {
+        if (pager -> inTransaction) {
+            return EXECUTE_TRANSACTION_ACTIVE;
+        }
+        pagerBegin(pager);
+        return EXECUTE_SUCCESS;
+    }
+
+    if (!pager -> inTransaction) {
+        return EXECUTE_NO_TRANSACTION;
+    }
+    if (statement -> type == STATEMENT_COMMIT) {
+        pagerCommitTransaction(pager);
+    } else {
+        pagerRollback(pager);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult executeCreateIndex(Statement* statement, Table* table) {
+    if (table -> pager -> inTransaction) {
+        return EXECUTE_INDEX_IN_TRANSACTION;
+    }
+    if (indexRootPageNum(table -> pager, statement -> column) != 0) {
+        return EXECUTE_INDEX_EXISTS;
+    }
+    createIndex(table, statement -> column);
+    return EXECUTE_SUCCESS;
+}
+
+/*
+ * Outside a transaction every statement commits on its own.
+ */
+ExecuteResult executeStatement(Statement *statement, Table* table, ResultSink* sink) {
+    uint64_t started = statsNow();
+    ExecuteResult result = EXECUTE_SUCCESS;
     switch (statement -> type) {
         case STATEMENT_INSERT:
-            return executeInsert(statement, table);
+            result = executeInsert(statement, table);
+            break;
+        case STATEMENT_DELETE:
+            result = executeDelete(statement, table);
+            break;
+        case STATEMENT_UPDATE:
+            result = executeUpdate(statement, table);
+            break;
         case STATEMENT_SELECT:
-            return executeSelect(statement, table);
+            result = executeSelect(statement, table, sink);
+            break;
+        case STATEMENT_CREATE_INDEX:
+            result = executeCreateIndex(statement, table);
+            break;
+        case STATEMENT_BEGIN:
+        case STATEMENT_COMMIT:
+        case STATEMENT_ROLLBACK:
+            result = executeTransaction(statement, table);
+            statsRecordStatement(statement -> type, started);
+            return result;
+        case NUM_STATEMENT_TYPES:
+            // Only sizes the per-statement arrays; never prepared
+            break;
+    }
+    if (!table -> pager -> inTransaction) {
+        pagerCommit(table -> pager);
+    }
+    statsRecordStatement(statement -> type, started);
+    return result;
+}
+
+/*
+ * Run one line of input and report how it went. Returns false if it failed.
+ */
+bool runInput(InputBuffer* inputBuffer, Table* table, Statement* statement, ResultSink* sink) {
+    if (inputBuffer -> buffer[0] == '.') {
+        switch (createMetaCommand(inputBuffer, table, sink)) {
+            case META_COMMAND_SUCCESS:
+                return true;
+            case META_COMMAND_UNRECOGNIZED:
+                fprintf(sink -> messages, "Unrecognized command '%s'\n", inputBuffer -> buffer);
+                if (!(sink -> batch)) {
+                    exit(EXIT_FAILURE);
+                }
+                return false;
+        }
+    }
+
+    switch (prepareStatement(inputBuffer, statement)) {
+        case PREPARE_SUCCESS:
+            break;
+        case PREPARE_NEGATIVE_ID:
+            fprintf(sink -> messages, "ID must be positive.\n");
+            return false;
+        case PREPARE_STRING_TOO_LONG:
+            fprintf(sink -> messages, "String is too long.\n");
+            return false;
+        case PREPARE_SYNTAX_ERROR:
+            fprintf(sink -> messages, "Syntax error. Could not parse statement.\n");
+            return false;
+        case PREPARE_UNRECOGNIZED_STATEMENT:
+            fprintf(sink -> messages, "Unrecognized keyword at start of '%s'.\n", inputBuffer -> buffer);
+            return false;
+    }
+
+    switch (executeStatement(statement, table, sink)) {
+        case EXECUTE_SUCCESS:
+            if (!(sink -> batch)) {
+                fprintf(sink -> messages, "Executed.\n");
+            }
+            return true;
+        case EXECUTE_DUPLICATE_KEY:
+            fprintf(sink -> messages, "Error: Duplicate key.\n");
+            break;
+        case EXECUTE_TRANSACTION_ACTIVE:
+            fprintf(sink -> messages, "Error: A transaction is already active.\n");
+            break;
+        case EXECUTE_NO_TRANSACTION:
+            fprintf(sink -> messages, "Error: No transaction is active.\n");
+            break;
+        case EXECUTE_TRANSACTION_FULL:
+            fprintf(sink -> messages, "Error: Transaction is too large for the buffer pool.\n");
+            break;
+        case EXECUTE_TRANSACTIONS_UNSUPPORTED:
+            fprintf(sink -> messages, "Error: Transactions are not supported in mmap mode.\n");
+            break;
+        case EXECUTE_INDEX_EXISTS:
+            fprintf(sink -> messages, "Error: That column is already indexed.\n");
+            break;
+        case EXECUTE_INDEX_IN_TRANSACTION:
+            fprintf(sink -> messages, "Error: Cannot create an index inside a transaction.\n");
+            break;
     }
+    return false;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
+    char* filename = NULL;
+    PagerOptions options = { PAGER_POOL, DEFAULT_POOL_FRAMES, WAL_GROUP_COMMIT_SIZE, PAGER_READAHEAD_PAGES, false };
+    OutputFormat format = OUTPUT_TEXT;
+    int script = STDIN_FILENO;
+    bool batch = false;
+    bool timer = false;
+    int scanThreads = 0;
+    char* servePath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.numFrames = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--group-commit") == 0 && i + 1 < argc) {
+            options.groupCommitSize = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.mode = PAGER_MMAP;
+        } else if (strcmp(argv[i], "--readahead") == 0 && i + 1 < argc) {
+            options.readaheadPages = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sync-io") == 0) {
+            options.syncIo = true;
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            if (!parseOutputFormat(argv[++i], &format)) {
+                printf("Output mode must be text, csv or binary.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            script = open(argv[++i], O_RDONLY);
+            if (script == -1) {
+                printf("Could not open script '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            batch = true;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(argv[i], "--timer") == 0) {
+            timer = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            scanThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            servePath = argv[++i];
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if (filename == NULL) {
         printf("Must supply a database filename.\n");
         exit(EXIT_FAILURE);
     }
-    char* filename = argv[1];
-    Table* table = openDB(filename);
+    Table* table = openDB(filename, options);
+    if (scanThreads > 0) {
+        table -> scanThreads = (uint32_t) scanThreads;
+    }
+    if (servePath != NULL) {
+        serve(table, servePath, format);
+        closeDB(table);
+        exit(EXIT_SUCCESS);
+    }
+
+    // Everything written to stdout is flushed explicitly, before blocking on input
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    ResultSink sink;
+    sinkInit(&sink, format, batch, timer);
 
-    InputBuffer* inputBuffer = createInputBuffer();
+    InputBuffer* inputBuffer = createInputBuffer(script);
+    Statement statement = { 0 };
+    bool failed = false;
     for (;;) {
-        printPrompt();
-        readInput(inputBuffer);
-
-        if(inputBuffer -> buffer[0] == '.') {
-            switch (createMetaCommand(inputBuffer, table)) {
-                case META_COMMAND_SUCCESS:
-                    continue;
-                case META_COMMAND_UNRECOGNIZED:
-                    printf("Unrecognized command '%s'\n", inputBuffer -> buffer);
-                    exit(EXIT_FAILURE);
+        printPrompt(&sink);
+        if (!readInput(inputBuffer, table)) {
+            if (batch) {
+                closeDB(table);
+                exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
             }
+            pagerSync(table -> pager);
+            printf("Error reading input\n");
+            exit(EXIT_FAILURE);
         }
-
-        Statement statement;
-        switch (prepareStatement(inputBuffer, &statement)) {
-            case PREPARE_SUCCESS:
-                break;
-            case PREPARE_NEGATIVE_ID:
-                printf("ID must be positive.\n");
-                continue;
-            case PREPARE_STRING_TOO_LONG:
-                printf("String is too long.\n");
-                continue;
-            case PREPARE_SYNTAX_ERROR:
-                printf("Syntax error. Could not parse statement.\n");
-                continue;
-            case PREPARE_UNRECOGNIZED_STATEMENT:
-                printf("Unrecognized keyword at start of '%s'.\n", inputBuffer -> buffer);
-                continue;
+        if (isBlankInput(inputBuffer)) {
+            continue;
         }
 
-        switch (executeStatement(&statement, table)) {
-            case EXECUTE_SUCCESS:
-                printf("Executed.\n");
-                break;
-            case EXECUTE_TABLE_FULL:
-                printf("Error: Table full.\n");
-                break;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!runInput(inputBuffer, table, &statement, &sink)) {
+            failed = true;
+        }
+        if (sink.timer) {
+            fprintf(sink.messages, "Time: %.6fs\n", elapsedSeconds(&start));
         }
     }
-}
\ No newline at end of file
+}
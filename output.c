@@ -0,0 +1,226 @@
+#include "import.c"
+
+/*
+ * Result rows in one of three formats:
+ *   text    (1, alice, alice@x)
+ *   csv     1,alice,alice@x, with fields quoted when they need it
+ *   binary  4-byte little-endian id, then each string behind a one byte length
+ *
+ * An aggregate is a single value: (42), 42, or a one byte flag followed by the
+ * 8-byte little-endian value. min and max of no rows have no value and come
+ * out as (NULL), an empty line, or a zero flag byte.
+ */
+
+bool parseOutputFormat(const char* name, OutputFormat* format) {
+    if (strcmp(name, "text") == 0) {
+        *format = OUTPUT_TEXT;
+    } else if (strcmp(name, "csv") == 0) {
+        *format = OUTPUT_CSV;
+    } else if (strcmp(name, "binary") == 0) {
+        *format = OUTPUT_BINARY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void sinkSetFormat(ResultSink* sink, OutputFormat format) {
+    sink -> format = format;
+    sink -> messages = (format == OUTPUT_TEXT && !(sink -> batch)) ? stdout : stderr;
+}
+
+void sinkInit(ResultSink* sink, OutputFormat format, bool batch, bool timer) {
+    sink -> buffer = (char*) malloc(OUTPUT_BUFFER_SIZE);
+    sink -> length = 0;
+    sink -> batch = batch;
+    sink -> timer = timer;
+    sink -> queue = NULL;
+    sinkSetFormat(sink, format);
+}
+
+void outputQueueAppend(OutputQueue* queue, const void* data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (queue -> length + length > queue -> capacity) {
+        size_t capacity = queue -> capacity > 0 ? queue -> capacity : SERVER_READ_SIZE;
+        while (capacity < queue -> length + length) {
+            capacity *= 2;
+        }
+        queue -> data = (char*) realloc(queue -> data, capacity);
+        queue -> capacity = capacity;
+    }
+    memcpy(queue -> data + queue -> length, data, length);
+    queue -> length += length;
+}
+
+/*
+ * A response frame: 4-byte little-endian payload length, the type byte, then
+ * the payload.
+ */
+void outputQueueFrame(OutputQueue* queue, ResponseType type, const void* payload, size_t length) {
+    uint8_t header[5];
+    for (uint32_t i = 0; i < 4; i++) {
+        header[i] = (uint8_t) ((length >> (8 * i)) & 0xff);
+    }
+    header[4] = (uint8_t) type;
+    outputQueueAppend(queue, header, sizeof(header));
+    outputQueueAppend(queue, payload, length);
+}
+
+void sinkFlush(ResultSink* sink) {
+    if (sink -> queue != NULL) {
+        if (sink -> length > 0) {
+            outputQueueFrame(sink -> queue, RESPONSE_ROWS, sink -> buffer, sink -> length);
+        }
+    } else if (sink -> length > 0 && fwrite(sink -> buffer, 1, sink -> length, stdout) != sink -> length) {
+        fprintf(stderr, "Error writing output.\n");
+        exit(EXIT_FAILURE);
+    }
+    sink -> length = 0;
+}
+
+/*
+ * Room for length more bytes at the end of the buffer.
+ */
+char* sinkReserve(ResultSink* sink, size_t length) {
+    if (sink -> length + length > OUTPUT_BUFFER_SIZE) {
+        sinkFlush(sink);
+    }
+    return sink -> buffer + sink -> length;
+}
+
+char* formatUint32(char* out, uint32_t value) {
+    char digits[10];
+    uint32_t numDigits = 0;
+    do {
+        digits[numDigits++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (numDigits > 0) {
+        *out++ = digits[--numDigits];
+    }
+    return out;
+}
+
+char* formatCsvField(char* out, const char* field, uint8_t length) {
+    bool needsQuotes = false;
+    for (uint32_t i = 0; i < length; i++) {
+        char c = field[i];
+        needsQuotes |= c == ',' || c == '"' || c == '\n' || c == '\r';
+    }
+    if (!needsQuotes) {
+        memcpy(out, field, length);
+        return out + length;
+    }
+    *out++ = '"';
+    for (uint32_t i = 0; i < length; i++) {
+        if (field[i] == '"') {
+            *out++ = '"';
+        }
+        *out++ = field[i];
+    }
+    *out++ = '"';
+    return out;
+}
+
+void sinkRow(ResultSink* sink, uint32_t id, const char* username, uint8_t usernameLength,
+             const char* email, uint8_t emailLength) {
+    // Enough for the id, the separators and two fully quoted strings
+    char* start = sinkReserve(sink, 16 + 2 * (2 * (size_t) usernameLength + 2) + 2 * (2 * (size_t) emailLength + 2));
+    char* out = start;
+    statsAdd(&(engineStats.rowsReturned), 1);
+    switch (sink -> format) {
+        case OUTPUT_TEXT:
+            *out++ = '(';
+            out = formatUint32(out, id);
+            *out++ = ',';
+            *out++ = ' ';
+            memcpy(out, username, usernameLength);
+            out += usernameLength;
+            *out++ = ',';
+            *out++ = ' ';
+            memcpy(out, email, emailLength);
+            out += emailLength;
+            *out++ = ')';
+            *out++ = '\n';
+            break;
+        case OUTPUT_CSV:
+            out = formatUint32(out, id);
+            *out++ = ',';
+            out = formatCsvField(out, username, usernameLength);
+            *out++ = ',';
+            out = formatCsvField(out, email, emailLength);
+            *out++ = '\n';
+            break;
+        case OUTPUT_BINARY:
+            *out++ = (char) (id & 0xff);
+            *out++ = (char) ((id >> 8) & 0xff);
+            *out++ = (char) ((id >> 16) & 0xff);
+            *out++ = (char) (id >> 24);
+            *out++ = (char) usernameLength;
+            memcpy(out, username, usernameLength);
+            out += usernameLength;
+            *out++ = (char) emailLength;
+            memcpy(out, email, emailLength);
+            out += emailLength;
+            break;
+    }
+    sink -> length += out - start;
+}
+
+void sinkWriteAggregate(ResultSink* sink, Aggregate aggregate, AggregateState* state) {
+    bool hasValue = aggregate == AGGREGATE_COUNT || aggregate == AGGREGATE_SUM || state -> count > 0;
+    uint64_t value = state -> count;
+    if (aggregate == AGGREGATE_MIN) {
+        value = state -> min;
+    } else if (aggregate == AGGREGATE_MAX) {
+        value = state -> max;
+    } else if (aggregate == AGGREGATE_SUM) {
+        value = state -> sum;
+    }
+
+    char* start = sinkReserve(sink, 32);
+    char* out = start;
+    statsAdd(&(engineStats.rowsReturned), 1);
+    switch (sink -> format) {
+        case OUTPUT_TEXT:
+            if (hasValue) {
+                out += sprintf(out, "(%llu)\n", (unsigned long long) value);
+            } else {
+                out += sprintf(out, "(NULL)\n");
+            }
+            break;
+        case OUTPUT_CSV:
+            if (hasValue) {
+                out += sprintf(out, "%llu", (unsigned long long) value);
+            }
+            *out++ = '\n';
+            break;
+        case OUTPUT_BINARY:
+            *out++ = (char) hasValue;
+            if (hasValue) {
+                for (uint32_t i = 0; i < 8; i++) {
+                    *out++ = (char) ((value >> (8 * i)) & 0xff);
+                }
+            }
+            break;
+    }
+    sink -> length += out - start;
+}
+
+void sinkWriteRow(ResultSink* sink, Row* row) {
+    sinkRow(sink, row -> id, row -> username, (uint8_t) strlen(row -> username),
+            row -> email, (uint8_t) strlen(row -> email));
+}
+
+/*
+ * Write the batch rows listed in selected, or every row if selected is NULL.
+ */
+void sinkWriteBatch(ResultSink* sink, RowBatch* batch, uint32_t* selected, uint32_t numSelected) {
+    for (uint32_t i = 0; i < numSelected; i++) {
+        uint32_t row = selected == NULL ? i : selected[i];
+        sinkRow(sink, batch -> ids[row], batch -> usernames[row], batch -> usernameLengths[row],
+                batch -> emails[row], batch -> emailLengths[row]);
+    }
+}
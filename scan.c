@@ -0,0 +1,283 @@
+#include <pthread.h>
+#include "output.c"
+
+/*
+ * Predicates over a whole batch. Each writes the positions of the matching rows
+ * to selected and returns how many there are.
+ */
+uint32_t batchSelectIdRange(RowBatch* batch, uint32_t low, uint32_t high, uint32_t* selected) {
+    uint32_t numSelected = 0;
+    for (uint32_t i = 0; i < batch -> numRows; i++) {
+        selected[numSelected] = i;
+        numSelected += batch -> ids[i] >= low && batch -> ids[i] <= high;
+    }
+    return numSelected;
+}
+
+uint32_t batchSelectValue(RowBatch* batch, Column column, const char* value, uint32_t* selected) {
+    const char** strings = column == COLUMN_USERNAME ? batch -> usernames : batch -> emails;
+    uint8_t* lengths = column == COLUMN_USERNAME ? batch -> usernameLengths : batch -> emailLengths;
+    size_t length = strlen(value);
+    uint32_t numSelected = 0;
+    for (uint32_t i = 0; i < batch -> numRows; i++) {
+        if (lengths[i] == length && memcmp(strings[i], value, length) == 0) {
+            selected[numSelected++] = i;
+        }
+    }
+    return numSelected;
+}
+
+void aggregateAdd(AggregateState* state, RowBatch* batch, uint32_t* selected, uint32_t numSelected) {
+    if (numSelected == 0) {
+        return;
+    }
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < numSelected; i++) {
+        sum += batch -> ids[selected == NULL ? i : selected[i]];
+    }
+    // Batches come in key order, so the first and last selected rows are the extremes
+    uint32_t first = batch -> ids[selected == NULL ? 0 : selected[0]];
+    uint32_t last = batch -> ids[selected == NULL ? numSelected - 1 : selected[numSelected - 1]];
+    if (state -> count == 0 || first < state -> min) {
+        state -> min = first;
+    }
+    if (state -> count == 0 || last > state -> max) {
+        state -> max = last;
+    }
+    state -> count += numSelected;
+    state -> sum += sum;
+}
+
+void aggregateAddId(AggregateState* state, uint32_t id) {
+    if (state -> count == 0 || id < state -> min) {
+        state -> min = id;
+    }
+    if (state -> count == 0 || id > state -> max) {
+        state -> max = id;
+    }
+    state -> count++;
+    state -> sum += id;
+}
+
+void aggregateMerge(AggregateState* state, AggregateState* partial) {
+    if (partial -> count == 0) {
+        return;
+    }
+    if (state -> count == 0 || partial -> min < state -> min) {
+        state -> min = partial -> min;
+    }
+    if (state -> count == 0 || partial -> max > state -> max) {
+        state -> max = partial -> max;
+    }
+    state -> count += partial -> count;
+    state -> sum += partial -> sum;
+}
+
+typedef struct {
+    uint32_t pageNum;
+    uint32_t low;
+    uint32_t high;
+} ScanSubtree;
+
+/*
+ * Cut [low, high] into morsels along the upper levels of the tree. Starting
+ * at the root, each level's nodes are replaced by their children until there
+ * are at least target subtrees or the leaves are reached; every subtree's key
+ * range that overlaps [low, high] becomes one morsel. The morsels partition
+ * the key space, so a split racing with this only makes them less even.
+ * Returns the number of morsels; the caller frees *morsels.
+ */
+uint32_t tableMorsels(Table* table, uint32_t low, uint32_t high, uint32_t target, Morsel** morsels) {
+    Pager* pager = table -> pager;
+    uint32_t numSubtrees = 1;
+    ScanSubtree* subtrees = (ScanSubtree*) malloc(sizeof(ScanSubtree));
+    subtrees[0].pageNum = table -> rootPageNum;
+    subtrees[0].low = 0;
+    subtrees[0].high = UINT32_MAX;
+
+    while (numSubtrees < target) {
+        void* node = getPageLatched(pager, subtrees[0].pageNum, false);
+        bool leaves = getNodeType(node) == NODE_LEAF;
+        unlatchPage(pager, node);
+        if (leaves) {
+            break;
+        }
+
+        uint32_t numChildren = 0;
+        uint32_t capacity = numSubtrees * (INTERNAL_NODE_MAX_CELLS + 1);
+        ScanSubtree* children = (ScanSubtree*) malloc(capacity * sizeof(ScanSubtree));
+        for (uint32_t i = 0; i < numSubtrees; i++) {
+            node = getPageLatched(pager, subtrees[i].pageNum, false);
+            uint32_t numKeys = *internalNodeNumKeys(node);
+            uint32_t childLow = subtrees[i].low;
+            for (uint32_t child = 0; child <= numKeys; child++) {
+                uint32_t childHigh = child < numKeys ? *internalNodeKey(node, child) : subtrees[i].high;
+                if (childHigh > subtrees[i].high) {
+                    childHigh = subtrees[i].high;
+                }
+                if (childLow <= childHigh) {
+                    children[numChildren].pageNum = *internalNodeChild(node, child);
+                    children[numChildren].low = childLow;
+                    children[numChildren].high = childHigh;
+                    numChildren++;
+                }
+                if (childHigh == subtrees[i].high) {
+                    break;
+                }
+                childLow = childHigh + 1;
+            }
+            unlatchPage(pager, node);
+        }
+        free(subtrees);
+        subtrees = children;
+        numSubtrees = numChildren;
+    }
+
+    *morsels = (Morsel*) malloc(numSubtrees * sizeof(Morsel));
+    uint32_t numMorsels = 0;
+    for (uint32_t i = 0; i < numSubtrees; i++) {
+        if (subtrees[i].high < low || subtrees[i].low > high) {
+            continue;
+        }
+        (*morsels)[numMorsels].low = subtrees[i].low > low ? subtrees[i].low : low;
+        (*morsels)[numMorsels].high = subtrees[i].high < high ? subtrees[i].high : high;
+        numMorsels++;
+    }
+    free(subtrees);
+    return numMorsels;
+}
+
+typedef struct {
+    Table* table;
+    Statement* statement;
+    Morsel* morsels;
+    uint32_t numMorsels;
+    uint32_t nextMorsel;
+} ParallelScan;
+
+typedef struct {
+    ParallelScan* scan;
+    AggregateState state;
+} ScanWorker;
+
+void scanMorsel(ParallelScan* scan, Morsel* morsel, AggregateState* state) {
+    Statement* statement = scan -> statement;
+    RowBatch batch = { 0 };
+    uint32_t selected[ROW_BATCH_SIZE];
+    Cursor* cursor = tableSeek(scan -> table, morsel -> low);
+    while (cursorNextBatch(cursor, &batch)) {
+        // The seek put the first row at or above low; cut off the rows past high
+        bool last = batch.ids[batch.numRows - 1] >= morsel -> high;
+        while (batch.numRows > 0 && batch.ids[batch.numRows - 1] > morsel -> high) {
+            batch.numRows--;
+        }
+        if (statement -> hasValueMatch) {
+            aggregateAdd(state, &batch, selected, batchSelectValue(&batch, statement -> column, statement -> value, selected));
+        } else {
+            aggregateAdd(state, &batch, NULL, batch.numRows);
+        }
+        if (last) {
+            break;
+        }
+    }
+    rowBatchRelease(scan -> table -> pager, &batch);
+    free(cursor);
+}
+
+/*
+ * Claim morsels until none are left. Morsels are handed out from one shared
+ * counter, so a worker that finishes early simply takes more of them.
+ */
+void* scanWorkerRun(void* argument) {
+    ScanWorker* worker = (ScanWorker*) argument;
+    ParallelScan* scan = worker -> scan;
+    for (;;) {
+        uint32_t next = __atomic_fetch_add(&(scan -> nextMorsel), 1, __ATOMIC_RELAXED);
+        if (next >= scan -> numMorsels) {
+            return NULL;
+        }
+        scanMorsel(scan, &(scan -> morsels[next]), &(worker -> state));
+    }
+}
+
+/*
+ * Aggregate the ids of the rows the statement selects by scanning the table
+ * with up to table -> scanThreads threads, the calling one included. Each
+ * worker keeps its own partial result and they are merged at the end.
+ */
+void parallelAggregate(Table* table, Statement* statement, AggregateState* result) {
+    memset(result, 0, sizeof(AggregateState));
+    uint32_t low = statement -> hasIdRange ? statement -> idLow : 0;
+    uint32_t high = statement -> hasIdRange ? statement -> idHigh : UINT32_MAX;
+    if (low > high) {
+        return;
+    }
+
+    uint32_t numThreads = table -> scanThreads;
+    if (numThreads > SCAN_MAX_THREADS) {
+        numThreads = SCAN_MAX_THREADS;
+    }
+    if (numThreads == 0 || table -> pager -> mode == PAGER_MMAP) {
+        // The mmap pager has no latches, so it is only ever read from one thread
+        numThreads = 1;
+    }
+
+    ParallelScan scan;
+    scan.table = table;
+    scan.statement = statement;
+    scan.nextMorsel = 0;
+    scan.numMorsels = tableMorsels(table, low, high, numThreads * SCAN_MORSELS_PER_THREAD, &(scan.morsels));
+    if (numThreads > scan.numMorsels) {
+        numThreads = scan.numMorsels > 0 ? scan.numMorsels : 1;
+    }
+
+    ScanWorker workers[SCAN_MAX_THREADS];
+    pthread_t threads[SCAN_MAX_THREADS];
+    uint32_t numStarted = 0;
+    for (uint32_t i = 0; i < numThreads; i++) {
+        workers[i].scan = &scan;
+        memset(&(workers[i].state), 0, sizeof(AggregateState));
+    }
+    // Workers that fail to start just leave more morsels for the rest
+    for (uint32_t i = 1; i < numThreads; i++) {
+        if (pthread_create(&threads[numStarted], NULL, scanWorkerRun, &workers[numStarted + 1]) == 0) {
+            numStarted++;
+        }
+    }
+    scanWorkerRun(&workers[0]);
+    for (uint32_t i = 0; i < numStarted; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (uint32_t i = 0; i <= numStarted; i++) {
+        aggregateMerge(result, &(workers[i].state));
+    }
+    free(scan.morsels);
+}
+
+/*
+ * count, min and max over an id range, from the row counts in internal nodes
+ * alone. The rows in [low, high] are those ranked from the rank of low up to
+ * the rank of high + 1, and min and max are the keys at either end, so only a
+ * few root-to-leaf paths are read whatever the size of the range.
+ */
+void countedAggregate(Table* table, Statement* statement, AggregateState* result) {
+    memset(result, 0, sizeof(AggregateState));
+    uint32_t low = statement -> hasIdRange ? statement -> idLow : 0;
+    uint32_t high = statement -> hasIdRange ? statement -> idHigh : UINT32_MAX;
+    if (low > high) {
+        return;
+    }
+
+    uint32_t first = tableRank(table, low);
+    uint32_t end = high == UINT32_MAX ? tableRowCount(table) : tableRank(table, high + 1);
+    if (end <= first) {
+        return;
+    }
+    result -> count = end - first;
+    if (statement -> aggregate == AGGREGATE_MIN) {
+        result -> min = tableKeyAtRank(table, first);
+    } else if (statement -> aggregate == AGGREGATE_MAX) {
+        result -> max = tableKeyAtRank(table, end - 1);
+    }
+}
@@ -0,0 +1,186 @@
+#include "insert.c"
+
+/*
+ * The optional count(*), min(id), max(id) or sum(id) after select.
+ */
+PrepareResult prepareAggregate(Lexer* lexer, Statement* statement) {
+    size_t position = lexer->position;
+    Token name = lexerNext(lexer);
+    if (tokenIs(name, "count")) {
+        statement->aggregate = AGGREGATE_COUNT;
+    } else if (tokenIs(name, "min")) {
+        statement->aggregate = AGGREGATE_MIN;
+    } else if (tokenIs(name, "max")) {
+        statement->aggregate = AGGREGATE_MAX;
+    } else if (tokenIs(name, "sum")) {
+        statement->aggregate = AGGREGATE_SUM;
+    } else {
+        statement->aggregate = AGGREGATE_NONE;
+        lexer->position = position;
+        return PREPARE_SUCCESS;
+    }
+
+    if (!tokenIs(lexerNext(lexer), "(")) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    Token argument = lexerNext(lexer);
+    bool countAll = statement->aggregate == AGGREGATE_COUNT && tokenIs(argument, "*");
+    if ((!countAll && !tokenIs(argument, "id")) || !tokenIs(lexerNext(lexer), ")")) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * The rest of a where clause on id after its operator: = N, < N, <= N, > N,
+ * >= N or between A and B. A comparison nothing can match, like < 0, leaves
+ * idLow above idHigh.
+ */
+PrepareResult prepareIdRange(Lexer* lexer, Token operator, Statement* statement) {
+    bool orEqual = false;
+    if (tokenIs(operator, "<") || tokenIs(operator, ">")) {
+        size_t position = lexer->position;
+        orEqual = tokenIs(lexerNext(lexer), "=");
+        if (!orEqual) {
+            lexer->position = position;
+        }
+    }
+    uint32_t id;
+    PrepareResult result = tokenToId(lexerNext(lexer), &id);
+    if (result != PREPARE_SUCCESS) {
+        return result;
+    }
+
+    statement->idLow = 0;
+    statement->idHigh = UINT32_MAX;
+    if (tokenIs(operator, "=")) {
+        statement->idLow = id;
+        statement->idHigh = id;
+    } else if (tokenIs(operator, "<")) {
+        statement->idLow = !orEqual && id == 0 ? 1 : 0;
+        statement->idHigh = orEqual || id == 0 ? id : id - 1;
+    } else if (tokenIs(operator, ">")) {
+        statement->idLow = orEqual || id == UINT32_MAX ? id : id + 1;
+        statement->idHigh = !orEqual && id == UINT32_MAX ? 0 : UINT32_MAX;
+    } else if (tokenIs(operator, "between")) {
+        statement->idLow = id;
+        if (!tokenIs(lexerNext(lexer), "and")) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        result = tokenToId(lexerNext(lexer), &(statement->idHigh));
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (!lexerAtEnd(lexer)) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    statement->hasIdRange = true;
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * select [count(*) | min(id) | max(id) | sum(id)]
+ *     followed by one of
+ * where id = N, < N, <= N, > N or >= N
+ * where id between A and B
+ * where username = '...'
+ * where email = '...'
+ */
+PrepareResult prepareSelect(Lexer* lexer, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->hasIdRange = false;
+    statement->hasValueMatch = false;
+
+    PrepareResult aggregateResult = prepareAggregate(lexer, statement);
+    if (aggregateResult != PREPARE_SUCCESS) {
+        return aggregateResult;
+    }
+
+    size_t position = lexer->position;
+    if (lexerAtEnd(lexer)) {
+        return PREPARE_SUCCESS;
+    }
+    lexer->position = position;
+
+    Token where = lexerNext(lexer);
+    Token column = lexerNext(lexer);
+    Token operator = lexerNext(lexer);
+    if (!tokenIs(where, "where")) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (!tokenIs(column, "id")) {
+        PrepareResult result = tokenToColumn(column, &(statement->column));
+        if (result == PREPARE_SUCCESS && !tokenIs(operator, "=")) {
+            result = PREPARE_SYNTAX_ERROR;
+        }
+        if (result == PREPARE_SUCCESS) {
+            result = tokenToString(lexerNext(lexer), statement->value, COLUMN_EMAIL_SIZE);
+        }
+        if (result == PREPARE_SUCCESS && !lexerAtEnd(lexer)) {
+            result = PREPARE_SYNTAX_ERROR;
+        }
+        statement->hasValueMatch = result == PREPARE_SUCCESS;
+        return result;
+    }
+
+    return prepareIdRange(lexer, operator, statement);
+}
+
+/*
+ * delete where id = N, < N, <= N, > N or >= N
+ * delete where id between A and B
+ */
+PrepareResult prepareDelete(Lexer* lexer, Statement* statement) {
+    statement->type = STATEMENT_DELETE;
+    statement->hasIdRange = false;
+    statement->hasValueMatch = false;
+    statement->aggregate = AGGREGATE_NONE;
+    if (!tokenIs(lexerNext(lexer), "where") || !tokenIs(lexerNext(lexer), "id")) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return prepareIdRange(lexer, lexerNext(lexer), statement);
+}
+
+/*
+ * update set username = '...', email = '...' where id = N
+ * update set ... where id < N, <= N, > N, >= N or between A and B
+ * Either column may be left out, but not both.
+ */
+PrepareResult prepareUpdate(Lexer* lexer, Statement* statement) {
+    statement->type = STATEMENT_UPDATE;
+    statement->hasIdRange = false;
+    statement->hasValueMatch = false;
+    statement->aggregate = AGGREGATE_NONE;
+    memset(statement->assigns, 0, sizeof(statement->assigns));
+    if (!tokenIs(lexerNext(lexer), "set")) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    Token token;
+    do {
+        Column column;
+        PrepareResult result = tokenToColumn(lexerNext(lexer), &column);
+        if (result != PREPARE_SUCCESS || statement->assigns[column] || !tokenIs(lexerNext(lexer), "=")) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (column == COLUMN_USERNAME) {
+            result = tokenToString(lexerNext(lexer), statement->assigned.username, COLUMN_USERNAME_SIZE);
+        } else {
+            result = tokenToString(lexerNext(lexer), statement->assigned.email, COLUMN_EMAIL_SIZE);
+        }
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+        statement->assigns[column] = true;
+        token = lexerNext(lexer);
+    } while (tokenIs(token, ","));
+
+    if (!tokenIs(token, "where") || !tokenIs(lexerNext(lexer), "id")) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return prepareIdRange(lexer, lexerNext(lexer), statement);
+}
@@ -0,0 +1,358 @@
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "scan.c"
+
+/*
+ * --serve: one process owns the table and answers local clients on a
+ * Unix-domain socket, so they all share its buffer pool.
+ *   request   4-byte little-endian length, then that many bytes of statement
+ *   response  frames (see outputQueueFrame): any number of rows frames in the
+ *             connection's output format, then one ok frame, or one error
+ *             frame carrying the message
+ * Clients may pipeline: requests are answered in order, and reading from a
+ * connection pauses while too much of its output is still unsent.
+ * Statements run one at a time on the event loop. A transaction holds back
+ * other connections' requests until it ends, and is rolled back if its
+ * connection goes away. As in the REPL, commits are synced as a group right
+ * before the responses to them are sent.
+ */
+
+typedef struct {
+    int fileDescriptor;
+    uint32_t events;
+    bool endOfInput;
+    OutputFormat format;
+    char* input;
+    size_t inputLength;
+    size_t inputCapacity;
+    OutputQueue output;
+} Connection;
+
+typedef struct {
+    Table* table;
+    int listener;
+    int epoll;
+    Connection** connections;
+    uint32_t numConnections;
+    uint32_t connectionCapacity;
+    // The connection whose transaction is open, if any
+    Connection* transactionOwner;
+    Statement statement;
+    ResultSink sink;
+    FILE* messages;
+    char* messageText;
+    size_t messageSize;
+} Server;
+
+// Defined in main.c
+bool runInput(InputBuffer* inputBuffer, Table* table, Statement* statement, ResultSink* sink);
+bool isBlankInput(InputBuffer* inputBuffer);
+
+volatile sig_atomic_t serverStopping = 0;
+
+void serverStop(int signal) {
+    (void) signal;
+    serverStopping = 1;
+}
+
+int serverListen(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path '%s' is too long.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // A socket file left by an earlier server would make bind fail
+    unlink(path);
+    if (listener == -1 || bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1
+        || listen(listener, SOMAXCONN) == -1) {
+        printf("Could not listen on '%s': %d\n", path, errno);
+        exit(EXIT_FAILURE);
+    }
+    return listener;
+}
+
+/*
+ * Wait for requests while there is room for them and their output, and for
+ * the socket to drain while output is pending. A connection with nothing to
+ * wait for leaves the epoll set, which would otherwise keep reporting a hung
+ * up peer.
+ */
+void connectionWatch(Server* server, Connection* connection) {
+    uint32_t events = 0;
+    if (!connection -> endOfInput && connection -> inputLength < SERVER_MAX_REQUEST_SIZE + 4
+        && connection -> output.length < SERVER_MAX_QUEUED_OUTPUT) {
+        events |= EPOLLIN;
+    }
+    if (connection -> output.length > connection -> output.start) {
+        events |= EPOLLOUT;
+    }
+    if (events == connection -> events) {
+        return;
+    }
+    struct epoll_event event = { events, { .ptr = connection } };
+    if (events == 0) {
+        epoll_ctl(server -> epoll, EPOLL_CTL_DEL, connection -> fileDescriptor, NULL);
+    } else {
+        epoll_ctl(server -> epoll, connection -> events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                  connection -> fileDescriptor, &event);
+    }
+    connection -> events = events;
+}
+
+void serverAccept(Server* server) {
+    for (;;) {
+        int fileDescriptor = accept(server -> listener, NULL, NULL);
+        if (fileDescriptor == -1) {
+            return;
+        }
+        fcntl(fileDescriptor, F_SETFL, O_NONBLOCK);
+        fcntl(fileDescriptor, F_SETFD, FD_CLOEXEC);
+        Connection* connection = (Connection*) calloc(1, sizeof(Connection));
+        connection -> fileDescriptor = fileDescriptor;
+        connection -> events = EPOLLIN;
+        connection -> format = server -> sink.format;
+        struct epoll_event event = { EPOLLIN, { .ptr = connection } };
+        if (epoll_ctl(server -> epoll, EPOLL_CTL_ADD, fileDescriptor, &event) == -1) {
+            close(fileDescriptor);
+            free(connection);
+            continue;
+        }
+        if (server -> numConnections == server -> connectionCapacity) {
+            server -> connectionCapacity = server -> connectionCapacity > 0 ? server -> connectionCapacity * 2 : 16;
+            server -> connections = (Connection**) realloc(server -> connections,
+                                                           server -> connectionCapacity * sizeof(Connection*));
+        }
+        server -> connections[server -> numConnections++] = connection;
+    }
+}
+
+void serverClose(Server* server, uint32_t index) {
+    Connection* connection = server -> connections[index];
+    if (server -> transactionOwner == connection) {
+        pagerRollback(server -> table -> pager);
+        server -> transactionOwner = NULL;
+    }
+    if (connection -> events != 0) {
+        epoll_ctl(server -> epoll, EPOLL_CTL_DEL, connection -> fileDescriptor, NULL);
+    }
+    close(connection -> fileDescriptor);
+    free(connection -> input);
+    free(connection -> output.data);
+    free(connection);
+    server -> connections[index] = server -> connections[--(server -> numConnections)];
+}
+
+/*
+ * Read whatever the socket has. The input always keeps a byte spare, so a
+ * request at its end can be terminated in place.
+ */
+void connectionRead(Connection* connection) {
+    while (!connection -> endOfInput) {
+        if (connection -> inputLength + SERVER_READ_SIZE + 1 > connection -> inputCapacity) {
+            connection -> inputCapacity = connection -> inputCapacity > 0 ? connection -> inputCapacity * 2 : 2 * SERVER_READ_SIZE;
+            connection -> input = (char*) realloc(connection -> input, connection -> inputCapacity);
+        }
+        ssize_t bytesRead = recv(connection -> fileDescriptor, connection -> input + connection -> inputLength,
+                                 connection -> inputCapacity - 1 - connection -> inputLength, 0);
+        if (bytesRead > 0) {
+            connection -> inputLength += bytesRead;
+            if (connection -> inputLength >= SERVER_MAX_REQUEST_SIZE + 4) {
+                return;
+            }
+        } else if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        } else if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else {
+            // The peer closed its end, or the connection broke
+            connection -> endOfInput = true;
+        }
+    }
+}
+
+/*
+ * Send as much queued output as the socket takes. Returns false if the
+ * connection is broken.
+ */
+bool connectionWrite(Connection* connection) {
+    OutputQueue* output = &(connection -> output);
+    while (output -> start < output -> length) {
+        ssize_t bytesWritten = send(connection -> fileDescriptor, output -> data + output -> start,
+                                    output -> length - output -> start, MSG_NOSIGNAL);
+        if (bytesWritten == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytesWritten == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        output -> start += bytesWritten;
+    }
+    output -> start = 0;
+    output -> length = 0;
+    return true;
+}
+
+void serverExecute(Server* server, Connection* connection, char* text, uint32_t length) {
+    InputBuffer request = { 0 };
+    request.buffer = text;
+    request.inputLength = length;
+
+    rewind(server -> messages);
+    ResultSink* sink = &(server -> sink);
+    sinkSetFormat(sink, connection -> format);
+    sink -> messages = server -> messages;
+    sink -> queue = &(connection -> output);
+
+    bool succeeded = true;
+    if (isBlankInput(&request)) {
+        // Nothing to run
+    } else if (strncmp(text, ".mode ", 6) == 0) {
+        succeeded = parseOutputFormat(text + 6, &(connection -> format));
+        if (!succeeded) {
+            fprintf(server -> messages, "Usage: .mode text|csv|binary\n");
+        }
+    } else if (text[0] == '.') {
+        // Other meta commands act on the whole process or print to its stdout
+        fprintf(server -> messages, "Unrecognized command '%s'\n", text);
+        succeeded = false;
+    } else {
+        succeeded = runInput(&request, server -> table, &(server -> statement), sink);
+    }
+    sinkFlush(sink);
+
+    fflush(server -> messages);
+    long messageLength = ftell(server -> messages);
+    outputQueueFrame(&(connection -> output), succeeded ? RESPONSE_OK : RESPONSE_ERROR, server -> messageText,
+                     (size_t) messageLength);
+    server -> transactionOwner = server -> table -> pager -> inTransaction ? connection : NULL;
+}
+
+/*
+ * Run the complete requests buffered on a connection, in order. Stops early
+ * while another connection's transaction is open or the output backlog is
+ * full. Returns false on a request too large to accept, after queueing an
+ * error frame for it; the caller stops reading, and the connection closes
+ * once its output has been sent.
+ */
+bool connectionRun(Server* server, Connection* connection, bool* progress) {
+    size_t consumed = 0;
+    while (connection -> inputLength - consumed >= 4 && connection -> output.length < SERVER_MAX_QUEUED_OUTPUT) {
+        if (server -> table -> pager -> inTransaction && server -> transactionOwner != connection) {
+            break;
+        }
+        uint8_t* header = (uint8_t*) (connection -> input + consumed);
+        uint32_t length = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t) header[3] << 24);
+        if (length > SERVER_MAX_REQUEST_SIZE) {
+            const char* message = "Request is too large.\n";
+            outputQueueFrame(&(connection -> output), RESPONSE_ERROR, message, strlen(message));
+            return false;
+        }
+        if (connection -> inputLength - consumed - 4 < length) {
+            break;
+        }
+
+        char* text = connection -> input + consumed + 4;
+        char following = text[length];
+        text[length] = '\0';
+        serverExecute(server, connection, text, length);
+        text[length] = following;
+        consumed += 4 + (size_t) length;
+        *progress = true;
+    }
+
+    if (consumed > 0) {
+        memmove(connection -> input, connection -> input + consumed, connection -> inputLength - consumed);
+        connection -> inputLength -= consumed;
+    }
+    return true;
+}
+
+/*
+ * Serve the table on a Unix-domain socket at path until SIGINT or SIGTERM.
+ */
+void serve(Table* table, const char* path, OutputFormat format) {
+    Server server;
+    memset(&server, 0, sizeof(Server));
+    server.table = table;
+    server.listener = serverListen(path);
+    server.epoll = epoll_create1(EPOLL_CLOEXEC);
+    server.messages = open_memstream(&(server.messageText), &(server.messageSize));
+    sinkInit(&(server.sink), format, true, false);
+    struct epoll_event listenEvent = { EPOLLIN, { .ptr = NULL } };
+    if (server.epoll == -1 || server.messages == NULL
+        || epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.listener, &listenEvent) == -1) {
+        printf("Could not start the server: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = serverStop;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int timeout = -1;
+    while (!serverStopping) {
+        int numEvents = epoll_wait(server.epoll, events, SERVER_MAX_EVENTS, timeout);
+        if (numEvents == -1 && errno != EINTR) {
+            printf("Error waiting for clients: %d\n", errno);
+            break;
+        }
+        for (int i = 0; i < numEvents; i++) {
+            if (events[i].data.ptr == NULL) {
+                serverAccept(&server);
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                connectionRead((Connection*) events[i].data.ptr);
+            }
+        }
+
+        // Ending a transaction can unblock connections already passed over
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            for (uint32_t i = 0; i < server.numConnections; i++) {
+                if (!connectionRun(&server, server.connections[i], &progress)) {
+                    server.connections[i] -> endOfInput = true;
+                    server.connections[i] -> inputLength = 0;
+                }
+            }
+        }
+
+        pagerSync(table -> pager);
+        Connection* owner = server.transactionOwner;
+        for (uint32_t i = 0; i < server.numConnections;) {
+            Connection* connection = server.connections[i];
+            bool broken = !connectionWrite(connection);
+            // A peer that stopped sending still gets the answers to what it sent
+            bool waiting = connection -> inputLength >= 4 && server.transactionOwner != NULL
+                           && server.transactionOwner != connection;
+            bool finished = connection -> endOfInput && connection -> output.length == 0 && !waiting;
+            if (broken || finished) {
+                serverClose(&server, i);
+                continue;
+            }
+            connectionWatch(&server, connection);
+            i++;
+        }
+        // Requests held back by a transaction that was just rolled back can run now
+        timeout = owner != NULL && server.transactionOwner == NULL ? 0 : -1;
+    }
+
+    while (server.numConnections > 0) {
+        serverClose(&server, server.numConnections - 1);
+    }
+    close(server.epoll);
+    close(server.listener);
+    unlink(path);
+    fclose(server.messages);
+    free(server.messageText);
+    free(server.sink.buffer);
+}
@@ -0,0 +1,38 @@
+#include <string.h>
+#include <time.h>
+#include "select.c"
+
+EngineStats engineStats;
+
+const char* STATEMENT_NAMES[NUM_STATEMENT_TYPES] = { "insert", "delete", "update", "select", "begin", "commit", "rollback", "create index" };
+
+uint64_t statsNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * For counters bumped on read paths, which may run on several threads at once.
+ */
+void statsAdd(uint64_t* counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+void statsReset() {
+    memset(&engineStats, 0, sizeof(EngineStats));
+}
+
+/*
+ * Count a statement of this type that began at started (from statsNow).
+ */
+void statsRecordStatement(StatementType type, uint64_t started) {
+    uint64_t nanoseconds = statsNow() - started;
+    uint32_t bucket = 0;
+    for (uint64_t microseconds = nanoseconds / 1000; microseconds > 0 && bucket < STATS_LATENCY_BUCKETS - 1; microseconds >>= 1) {
+        bucket++;
+    }
+    statsAdd(&(engineStats.statements[type]), 1);
+    statsAdd(&(engineStats.statementNanoseconds[type]), nanoseconds);
+    statsAdd(&(engineStats.latency[type][bucket]), 1);
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "constants.h"
+
+/*
+ * Splits a statement into words, numbers, quoted strings and the symbols ( ) , = < >.
+ * Tokens point into the input buffer; quoted strings are unescaped in place.
+ */
+void lexerInit(Lexer* lexer, char* input) {
+    lexer -> input = input;
+    lexer -> position = 0;
+}
+
+bool isSymbolChar(char c) {
+    return c == '(' || c == ')' || c == ',' || c == '=' || c == '<' || c == '>' || c == ';';
+}
+
+bool isSpaceChar(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+Token lexerNext(Lexer* lexer) {
+    char* input = lexer -> input;
+    size_t position = lexer -> position;
+    while (isSpaceChar(input[position])) {
+        position++;
+    }
+
+    Token token;
+    token.start = input + position;
+    token.length = 0;
+    char c = input[position];
+
+    if (c == '\0') {
+        token.type = TOKEN_END;
+    } else if (isSymbolChar(c)) {
+        token.type = TOKEN_SYMBOL;
+        token.length = 1;
+        position++;
+    } else if (c == '\'') {
+        // A doubled quote inside the string stands for one quote character
+        token.type = TOKEN_ERROR;
+        token.start = input + position + 1;
+        char* out = token.start;
+        position++;
+        while (input[position] != '\0') {
+            if (input[position] == '\'') {
+                if (input[position + 1] != '\'') {
+                    token.type = TOKEN_STRING;
+                    position++;
+                    break;
+                }
+                position++;
+            }
+            *out++ = input[position++];
+        }
+        token.length = out - token.start;
+    } else {
+        bool digits = true;
+        size_t start = position;
+        if (c == '-') {
+            position++;
+        }
+        while (input[position] != '\0' && !isSpaceChar(input[position]) && !isSymbolChar(input[position])
+               && input[position] != '\'') {
+            if (input[position] < '0' || input[position] > '9') {
+                digits = false;
+            }
+            position++;
+        }
+        token.length = position - start;
+        token.type = (digits && token.length > (c == '-' ? 1u : 0u)) ? TOKEN_NUMBER : TOKEN_WORD;
+    }
+
+    lexer -> position = position;
+    return token;
+}
+
+/*
+ * True if nothing but an optional trailing semicolon is left.
+ */
+bool lexerAtEnd(Lexer* lexer) {
+    Token token = lexerNext(lexer);
+    if (token.type == TOKEN_SYMBOL && token.start[0] == ';') {
+        token = lexerNext(lexer);
+    }
+    return token.type == TOKEN_END;
+}
+
+bool tokenIs(Token token, const char* text) {
+    return (token.type == TOKEN_WORD || token.type == TOKEN_SYMBOL)
+           && strlen(text) == token.length && strncmp(token.start, text, token.length) == 0;
+}
+
+/*
+ * Numbers are bare digit runs with an optional minus sign.
+ */
+PrepareResult tokenToId(Token token, uint32_t* id) {
+    if (token.type != TOKEN_NUMBER) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (token.start[0] == '-') {
+        return PREPARE_NEGATIVE_ID;
+    }
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < token.length; i++) {
+        value = value * 10 + (token.start[i] - '0');
+        if (value > UINT32_MAX) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+    *id = (uint32_t) value;
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * Only the string columns can be filtered on by value or indexed.
+ */
+PrepareResult tokenToColumn(Token token, Column* column) {
+    if (tokenIs(token, "username")) {
+        *column = COLUMN_USERNAME;
+    } else if (tokenIs(token, "email")) {
+        *column = COLUMN_EMAIL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * Column values may be quoted strings or bare words.
+ */
+PrepareResult tokenToString(Token token, char* destination, uint32_t maxLength) {
+    if (token.type != TOKEN_STRING && token.type != TOKEN_WORD && token.type != TOKEN_NUMBER) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (token.length > maxLength) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    memcpy(destination, token.start, token.length);
+    destination[token.length] = '\0';
+    return PREPARE_SUCCESS;
+}
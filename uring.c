@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "wal.c"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define URING_SUPPORTED
+#endif
+#endif
+
+/*
+ * Just enough io_uring for the pager: reads and writes at file offsets,
+ * queued in batches, submitted with one system call and reaped one
+ * completion at a time. Without kernel or header support uringOpen fails
+ * and the pager keeps to blocking pread and pwrite.
+ */
+
+#ifdef URING_SUPPORTED
+
+void uringClose(Uring* ring) {
+    if (ring -> sqes != NULL) {
+        munmap(ring -> sqes, ring -> sqesSize);
+    }
+    if (ring -> cqRing != NULL) {
+        munmap(ring -> cqRing, ring -> cqRingSize);
+    }
+    if (ring -> sqRing != NULL) {
+        munmap(ring -> sqRing, ring -> sqRingSize);
+    }
+    if (ring -> fileDescriptor != -1) {
+        close(ring -> fileDescriptor);
+    }
+    memset(ring, 0, sizeof(Uring));
+    ring -> fileDescriptor = -1;
+}
+
+void* uringMap(int fileDescriptor, size_t size, off_t offset) {
+    void* ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fileDescriptor, offset);
+    return ring == MAP_FAILED ? NULL : ring;
+}
+
+bool uringOpen(Uring* ring, uint32_t entries) {
+    memset(ring, 0, sizeof(Uring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring -> fileDescriptor = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring -> fileDescriptor == -1) {
+        return false;
+    }
+
+    ring -> sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring -> cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring -> sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring -> sqRing = uringMap(ring -> fileDescriptor, ring -> sqRingSize, IORING_OFF_SQ_RING);
+    ring -> cqRing = uringMap(ring -> fileDescriptor, ring -> cqRingSize, IORING_OFF_CQ_RING);
+    ring -> sqes = uringMap(ring -> fileDescriptor, ring -> sqesSize, IORING_OFF_SQES);
+    if (ring -> sqRing == NULL || ring -> cqRing == NULL || ring -> sqes == NULL) {
+        uringClose(ring);
+        return false;
+    }
+
+    ring -> sqHead = (uint32_t*) (ring -> sqRing + params.sq_off.head);
+    ring -> sqTail = (uint32_t*) (ring -> sqRing + params.sq_off.tail);
+    ring -> sqMask = *(uint32_t*) (ring -> sqRing + params.sq_off.ring_mask);
+    ring -> sqArray = (uint32_t*) (ring -> sqRing + params.sq_off.array);
+    ring -> cqHead = (uint32_t*) (ring -> cqRing + params.cq_off.head);
+    ring -> cqTail = (uint32_t*) (ring -> cqRing + params.cq_off.tail);
+    ring -> cqMask = *(uint32_t*) (ring -> cqRing + params.cq_off.ring_mask);
+    ring -> cqes = ring -> cqRing + params.cq_off.cqes;
+    ring -> entries = params.sq_entries;
+    return true;
+}
+
+/*
+ * Queue one request without submitting it. Returns false while entries
+ * requests are already in flight; the completion ring has room for at least
+ * that many, so it can never overflow.
+ */
+bool uringQueue(Uring* ring, uint8_t opcode, int fileDescriptor, void* buffer, uint32_t length, uint64_t offset,
+                uint64_t userData) {
+    if (ring -> inFlight >= ring -> entries) {
+        return false;
+    }
+    uint32_t tail = *(ring -> sqTail);
+    uint32_t index = tail & ring -> sqMask;
+    struct io_uring_sqe* sqe = &(((struct io_uring_sqe*) ring -> sqes)[index]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe -> opcode = opcode;
+    sqe -> fd = fileDescriptor;
+    sqe -> addr = (uint64_t) (uintptr_t) buffer;
+    sqe -> len = length;
+    sqe -> off = offset;
+    sqe -> user_data = userData;
+    ring -> sqArray[index] = index;
+    __atomic_store_n(ring -> sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring -> unsubmitted++;
+    ring -> inFlight++;
+    return true;
+}
+
+bool uringQueueRead(Uring* ring, int fileDescriptor, void* buffer, uint32_t length, uint64_t offset, uint64_t userData) {
+    return uringQueue(ring, IORING_OP_READ, fileDescriptor, buffer, length, offset, userData);
+}
+
+bool uringQueueWrite(Uring* ring, int fileDescriptor, void* buffer, uint32_t length, uint64_t offset, uint64_t userData) {
+    return uringQueue(ring, IORING_OP_WRITE, fileDescriptor, buffer, length, offset, userData);
+}
+
+/*
+ * Hand the queued requests to the kernel, waiting for minComplete of the
+ * requests in flight to finish.
+ */
+void uringEnter(Uring* ring, uint32_t minComplete) {
+    for (;;) {
+        long submitted = syscall(__NR_io_uring_enter, ring -> fileDescriptor, ring -> unsubmitted, minComplete,
+                                 minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0) {
+            ring -> unsubmitted -= (uint32_t) submitted;
+            return;
+        }
+        if (errno != EINTR) {
+            printf("Error submitting I/O: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void uringSubmit(Uring* ring) {
+    if (ring -> unsubmitted > 0) {
+        uringEnter(ring, 0);
+    }
+}
+
+/*
+ * Take one completion, blocking for it if wait is set. Returns false if
+ * there is none to take.
+ */
+bool uringReap(Uring* ring, bool wait, uint64_t* userData, int32_t* result) {
+    for (;;) {
+        uint32_t head = *(ring -> cqHead);
+        if (head != __atomic_load_n(ring -> cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &(((struct io_uring_cqe*) ring -> cqes)[head & ring -> cqMask]);
+            *userData = cqe -> user_data;
+            *result = cqe -> res;
+            __atomic_store_n(ring -> cqHead, head + 1, __ATOMIC_RELEASE);
+            ring -> inFlight--;
+            return true;
+        }
+        if (!wait || ring -> inFlight == 0) {
+            return false;
+        }
+        uringEnter(ring, 1);
+    }
+}
+
+#else
+
+bool uringOpen(Uring* ring, uint32_t entries) {
+    (void) entries;
+    memset(ring, 0, sizeof(Uring));
+    ring -> fileDescriptor = -1;
+    return false;
+}
+
+void uringClose(Uring* ring) {
+    ring -> fileDescriptor = -1;
+}
+
+bool uringQueueRead(Uring* ring, int fileDescriptor, void* buffer, uint32_t length, uint64_t offset, uint64_t userData) {
+    return false;
+}
+
+bool uringQueueWrite(Uring* ring, int fileDescriptor, void* buffer, uint32_t length, uint64_t offset, uint64_t userData) {
+    return false;
+}
+
+void uringSubmit(Uring* ring) {
+}
+
+bool uringReap(Uring* ring, bool wait, uint64_t* userData, int32_t* result) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "stats.c"
+
+uint32_t walChecksum(uint32_t seed, const void* data, size_t length) {
+    const uint32_t* words = (const uint32_t*) data;
+    uint32_t hash = seed ^ 2166136261u;
+    for (size_t i = 0; i < length / sizeof(uint32_t); i++) {
+        hash = (hash ^ words[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t walFrameChecksum(void* frameHeader, void* page) {
+    uint32_t seed = walChecksum(0, frameHeader, WAL_FRAME_CHECKSUM_OFFSET);
+    return walChecksum(seed, page, PAGE_SIZE);
+}
+
+void walWriteHeader(Wal* wal) {
+    uint32_t header[WAL_HEADER_SIZE / sizeof(uint32_t)];
+    header[WAL_HEADER_MAGIC_OFFSET / sizeof(uint32_t)] = WAL_MAGIC;
+    header[WAL_HEADER_VERSION_OFFSET / sizeof(uint32_t)] = WAL_VERSION;
+    header[WAL_HEADER_PAGE_SIZE_OFFSET / sizeof(uint32_t)] = PAGE_SIZE;
+    header[WAL_HEADER_SALT_OFFSET / sizeof(uint32_t)] = wal -> salt;
+
+    if (pwrite(wal -> fileDescriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE) {
+        printf("Error writing WAL header: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    engineStats.writeCalls++;
+    engineStats.bytesWritten += WAL_HEADER_SIZE;
+    wal -> length = WAL_HEADER_SIZE;
+}
+
+void walSync(Wal* wal) {
+    if (wal -> pendingCommits == 0) {
+        return;
+    }
+    if (fdatasync(wal -> fileDescriptor) == -1) {
+        printf("Error syncing WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    engineStats.syncCalls++;
+    wal -> pendingCommits = 0;
+}
+
+/*
+ * Start a new generation of the log. A fresh salt makes any frames left over
+ * from the previous generation fail validation during recovery.
+ */
+void walReset(Wal* wal) {
+    wal -> salt++;
+    if (ftruncate(wal -> fileDescriptor, 0) == -1) {
+        printf("Error truncating WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    walWriteHeader(wal);
+    if (fsync(wal -> fileDescriptor) == -1) {
+        printf("Error syncing WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    engineStats.syncCalls++;
+    wal -> framesSinceCheckpoint = 0;
+    wal -> pendingCommits = 0;
+}
+
+/*
+ * Copy every frame up to the last valid commit record into the database file.
+ * Frames after it belong to a commit that never finished and are ignored.
+ * Returns the page count of the database as of that commit.
+ */
+uint32_t walRecover(Wal* wal, int dbFileDescriptor, uint32_t dbPages) {
+    uint32_t header[WAL_HEADER_SIZE / sizeof(uint32_t)];
+    if (pread(wal -> fileDescriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE
+        || header[WAL_HEADER_MAGIC_OFFSET / sizeof(uint32_t)] != WAL_MAGIC
+        || header[WAL_HEADER_VERSION_OFFSET / sizeof(uint32_t)] != WAL_VERSION
+        || header[WAL_HEADER_PAGE_SIZE_OFFSET / sizeof(uint32_t)] != PAGE_SIZE) {
+        return dbPages;
+    }
+    wal -> salt = header[WAL_HEADER_SALT_OFFSET / sizeof(uint32_t)];
+
+    void* frame = malloc(WAL_FRAME_SIZE);
+    uint32_t* frameHeader = (uint32_t*) frame;
+    void* page = frame + WAL_FRAME_HEADER_SIZE;
+
+    // First pass: find where the last complete commit ends
+    off_t committedEnd = WAL_HEADER_SIZE;
+    uint32_t committedPages = dbPages;
+    for (off_t offset = WAL_HEADER_SIZE;; offset += WAL_FRAME_SIZE) {
+        if (pread(wal -> fileDescriptor, frame, WAL_FRAME_SIZE, offset) != WAL_FRAME_SIZE) {
+            break;
+        }
+        if (frameHeader[WAL_FRAME_SALT_OFFSET / sizeof(uint32_t)] != wal -> salt
+            || frameHeader[WAL_FRAME_CHECKSUM_OFFSET / sizeof(uint32_t)] != walFrameChecksum(frame, page)) {
+            break;
+        }
+        uint32_t commitPages = frameHeader[WAL_FRAME_COMMIT_OFFSET / sizeof(uint32_t)];
+        if (commitPages != 0) {
+            committedEnd = offset + WAL_FRAME_SIZE;
+            committedPages = commitPages;
+        }
+    }
+
+    // Second pass: replay in log order so the newest image of each page wins
+    for (off_t offset = WAL_HEADER_SIZE; offset < committedEnd; offset += WAL_FRAME_SIZE) {
+        if (pread(wal -> fileDescriptor, frame, WAL_FRAME_SIZE, offset) != WAL_FRAME_SIZE) {
+            printf("Error reading WAL: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t pageNum = frameHeader[WAL_FRAME_PAGE_NUM_OFFSET / sizeof(uint32_t)];
+        if (pwrite(dbFileDescriptor, page, PAGE_SIZE, (off_t) pageNum * PAGE_SIZE) != PAGE_SIZE) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(frame);
+
+    if (committedEnd > WAL_HEADER_SIZE && fsync(dbFileDescriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    return committedPages > dbPages ? committedPages : dbPages;
+}
+
+Wal* walOpen(const char* dbFilename, uint32_t groupCommitSize) {
+    size_t nameLength = strlen(dbFilename);
+    char* filename = (char*) malloc(nameLength + 5);
+    memcpy(filename, dbFilename, nameLength);
+    strcpy(filename + nameLength, "-wal");
+
+    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    free(filename);
+    if (fd == -1) {
+        printf("Unable to open WAL file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Wal* wal = (Wal*) malloc(sizeof(Wal));
+    wal -> fileDescriptor = fd;
+    wal -> salt = 0;
+    wal -> length = 0;
+    wal -> framesSinceCheckpoint = 0;
+    wal -> pendingCommits = 0;
+    wal -> groupCommitSize = groupCommitSize > 0 ? groupCommitSize : 1;
+    wal -> buffer = NULL;
+    wal -> bufferCapacity = 0;
+    return wal;
+}
+
+/*
+ * Append one commit worth of page images in a single write. The last frame
+ * carries the commit marker. The fsync is deferred to walSync so that a whole
+ * group of commits shares it.
+ */
+void walAppendCommit(Wal* wal, Frame** frames, uint32_t numFrames, uint32_t dbPages) {
+    size_t length = (size_t) numFrames * WAL_FRAME_SIZE;
+    if (length > wal -> bufferCapacity) {
+        free(wal -> buffer);
+        wal -> buffer = malloc(length);
+        wal -> bufferCapacity = length;
+    }
+
+    for (uint32_t i = 0; i < numFrames; i++) {
+        void* frame = wal -> buffer + (size_t) i * WAL_FRAME_SIZE;
+        uint32_t* frameHeader = (uint32_t*) frame;
+        frameHeader[WAL_FRAME_PAGE_NUM_OFFSET / sizeof(uint32_t)] = frames[i] -> pageNum;
+        frameHeader[WAL_FRAME_COMMIT_OFFSET / sizeof(uint32_t)] = (i == numFrames - 1) ? dbPages : 0;
+        frameHeader[WAL_FRAME_SALT_OFFSET / sizeof(uint32_t)] = wal -> salt;
+        memcpy(frame + WAL_FRAME_HEADER_SIZE, frames[i] -> data, PAGE_SIZE);
+        frameHeader[WAL_FRAME_CHECKSUM_OFFSET / sizeof(uint32_t)] = walFrameChecksum(frame, frame + WAL_FRAME_HEADER_SIZE);
+    }
+
+    if (pwrite(wal -> fileDescriptor, wal -> buffer, length, wal -> length) != (ssize_t) length) {
+        printf("Error writing WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    engineStats.writeCalls++;
+    engineStats.bytesWritten += length;
+    engineStats.walFramesWritten += numFrames;
+    wal -> length += length;
+    wal -> framesSinceCheckpoint += numFrames;
+    wal -> pendingCommits++;
+
+    if (wal -> pendingCommits >= wal -> groupCommitSize) {
+        walSync(wal);
+    }
+}
+
+void walClose(Wal* wal) {
+    if (close(wal -> fileDescriptor) == -1) {
+        printf("Error closing WAL file.\n");
+        exit(EXIT_FAILURE);
+    }
+    free(wal -> buffer);
+    free(wal);
+}